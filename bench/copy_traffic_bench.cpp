@@ -0,0 +1,105 @@
+#include "pipeline_builder.hpp"
+#include <chrono>
+#include <numeric>
+
+using namespace pipeline;
+
+// Measures how many payload bytes are copied while large buffers flow
+// through a pipeline: one source fanning out to several readers, whose
+// results are joined into the target. The source is also joined with a
+// second payload, so one join input has other consumers and one does not.
+
+constexpr size_t kPayloadBytes = 64 << 20;
+constexpr int kReaders = 4;
+constexpr int kIterations = 5;
+
+// Byte buffer which counts the bytes duplicated by its copies
+struct Payload {
+    static inline std::atomic<size_t> copied_bytes = 0;
+    std::vector<std::uint8_t> bytes;
+
+    Payload() = default;
+    explicit Payload(std::vector<std::uint8_t> bytes)
+        : bytes(std::move(bytes)) {}
+    Payload(const Payload &other) : bytes(other.bytes) {
+        copied_bytes += bytes.size();
+    }
+    Payload(Payload &&other) = default;
+    Payload &operator=(const Payload &other) {
+        bytes = other.bytes;
+        copied_bytes += bytes.size();
+        return *this;
+    }
+    Payload &operator=(Payload &&other) = default;
+};
+
+int main() {
+    Pipeline p;
+    Port<Payload> source =
+        p.add_stage("source", [] {
+             return Payload(std::vector<std::uint8_t>(kPayloadBytes, 1));
+         }).value();
+
+    std::vector<Port<size_t>> sums;
+    for (int i = 0; i < kReaders; i++) {
+        sums.push_back(p.add_stage("sum" + std::to_string(i),
+                                   [](const Payload &payload) {
+                                       return std::accumulate(
+                                           payload.bytes.begin(),
+                                           payload.bytes.end(), size_t{0});
+                                   },
+                                   source)
+                           .value());
+    }
+    Port<size_t> total = sums[0];
+    for (int i = 1; i < kReaders; i++) {
+        auto both =
+            p.join("join" + std::to_string(i), total, sums[i]).value();
+        total = p.add_stage("total" + std::to_string(i),
+                            [](const Joined<size_t, size_t> &sums) {
+                                return *sums.first + *sums.second;
+                            },
+                            both)
+                    .value();
+    }
+
+    Port<Payload> other =
+        p.add_stage("other", [] {
+             return Payload(std::vector<std::uint8_t>(kPayloadBytes, 1));
+         }).value();
+    auto payloads = p.join("payloads", source, other).value();
+    Port<size_t> sizes =
+        p.add_stage("sizes",
+                    [](const Joined<Payload, Payload> &both) {
+                        return both.first->bytes.size() +
+                               both.second->bytes.size();
+                    },
+                    payloads)
+            .value();
+    Port<size_t> target =
+        p.add_stage("target", [](size_t a, size_t b) { return a + b; }, total,
+                    sizes)
+            .value();
+
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+    Executor executor(threads);
+    Payload::copied_bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        if (p.run(target, executor).value() !=
+            (kReaders + 2) * kPayloadBytes) {
+            std::abort();
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << (kPayloadBytes >> 20) << " MiB payload read by " << kReaders
+              << " stages and joined with another, " << threads
+              << " threads\n";
+    std::cout << "  payload bytes copied: "
+              << Payload::copied_bytes / kIterations << " per run\n";
+    std::cout << "  "
+              << std::chrono::duration<double, std::milli>(elapsed).count() /
+                     kIterations
+              << " ms/run\n";
+}
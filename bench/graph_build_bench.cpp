@@ -0,0 +1,78 @@
+#include "pipeline_builder.hpp"
+#include <chrono>
+
+using namespace pipeline;
+
+// Measures building a graph of a million stages and compiling its plan. Each
+// stage reads its predecessor and the stage at half its index, so no stage
+// is fused away and the plan covers the whole graph. A short chain added
+// last is then run on its own, whose plan should cost as little as the
+// chain does, however large the rest of the graph is.
+
+constexpr size_t kStages = 1'000'000;
+constexpr size_t kSmallStages = 4;
+constexpr int kSmallRuns = 1000;
+
+template <class F> double millis(F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+int main() {
+    Pipeline p;
+    std::vector<Port<int>> ports;
+    ports.reserve(kStages);
+
+    double build = millis([&] {
+        ports.push_back(p.add_stage("stage0", [] { return 1; }).value());
+        for (size_t i = 1; i < kStages; i++) {
+            ports.push_back(p.add_stage("stage" + std::to_string(i),
+                                        [](int prev, int half) {
+                                            return (prev + half) % 1024;
+                                        },
+                                        ports[i - 1], ports[i / 2])
+                                .value());
+        }
+    });
+
+    Port<int> small = p.add_stage("small0", [] { return 1; }).value();
+    for (size_t i = 1; i < kSmallStages; i++) {
+        small = p.add_stage("small" + std::to_string(i),
+                            [](int x) { return x + 1; }, small)
+                    .value();
+    }
+
+    Executor executor(1);
+    double small_compile_and_run = millis([&] {
+        if (p.run(small, executor).value() != int(kSmallStages)) {
+            std::abort();
+        }
+    });
+    double small_run = millis([&] {
+        for (int i = 0; i < kSmallRuns; i++) {
+            if (p.run(small, executor).value() != int(kSmallStages)) {
+                std::abort();
+            }
+        }
+    });
+
+    int first = 0;
+    double compile_and_run =
+        millis([&] { first = p.run(ports.back(), executor).value(); });
+    double run = millis([&] {
+        if (p.run(ports.back(), executor).value() != first) {
+            std::abort();
+        }
+    });
+
+    std::cout << kStages << " stages\n";
+    std::cout << "  build:             " << build << " ms\n";
+    std::cout << "  compile plan, run: " << compile_and_run << " ms\n";
+    std::cout << "  run cached plan:   " << run << " ms\n";
+    std::cout << kSmallStages << " stage target in the same graph\n";
+    std::cout << "  compile plan, run: " << small_compile_and_run << " ms\n";
+    std::cout << "  run cached plan:   " << small_run / kSmallRuns
+              << " ms per run\n";
+}
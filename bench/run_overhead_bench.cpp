@@ -0,0 +1,53 @@
+#include "pipeline_builder.hpp"
+#include <chrono>
+
+using namespace pipeline;
+
+// Measures the fixed per-run cost of executing a 10-stage chain of trivial
+// stages, comparing threads spawned per run against a persistent Executor.
+
+constexpr int kChainLength = 10;
+constexpr int kIterations = 2000;
+
+template <class RunOnce> double micros_per_run(RunOnce &&run_once) {
+    // Warm up
+    for (int i = 0; i < kIterations / 10; i++) {
+        run_once();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        run_once();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::micro>(elapsed).count() /
+           kIterations;
+}
+
+int main() {
+    Pipeline p;
+    Port<int> port = p.add_stage("stage0", [] { return 0; }).value();
+    for (int i = 1; i < kChainLength; i++) {
+        port = p.add_stage("stage" + std::to_string(i),
+                           [](int x) { return x + 1; }, port)
+                   .value();
+    }
+
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+
+    double spawned = micros_per_run([&] {
+        if (p.run(port, threads).value() != kChainLength - 1) {
+            std::abort();
+        }
+    });
+
+    Executor executor(threads);
+    double pooled = micros_per_run([&] {
+        if (p.run(port, executor).value() != kChainLength - 1) {
+            std::abort();
+        }
+    });
+
+    std::cout << kChainLength << "-stage chain, " << threads << " threads\n";
+    std::cout << "  threads spawned per run: " << spawned << " us/run\n";
+    std::cout << "  persistent Executor:     " << pooled << " us/run\n";
+}
@@ -0,0 +1,66 @@
+#include "pipeline_builder.hpp"
+#include <chrono>
+
+using namespace pipeline;
+
+// Compares scheduler policies on a wide fan-out graph: one source feeding
+// many independent branches which are then reduced pairwise.
+
+constexpr int kBranches = 512;
+constexpr int kIterations = 50;
+
+int spin(int x) {
+    // A few microseconds of work per stage
+    volatile int acc = x;
+    for (int i = 0; i < 2000; i++) {
+        acc = acc + (i ^ x);
+    }
+    return acc;
+}
+
+int main() {
+    Pipeline p;
+    Port<int> src = p.add_stage("src", [] { return 1; }).value();
+    std::vector<Port<int>> level;
+    for (int i = 0; i < kBranches; i++) {
+        level.push_back(
+            p.add_stage("branch" + std::to_string(i), spin, src).value());
+    }
+    int id = 0;
+    while (level.size() > 1) {
+        std::vector<Port<int>> next;
+        for (size_t i = 0; i < level.size(); i += 2) {
+            auto joined =
+                p.join("join" + std::to_string(id), level[i], level[i + 1])
+                    .value();
+            next.push_back(p.add_stage("sum" + std::to_string(id),
+                                       [](const Joined<int, int> &in) {
+                                           return *in.first + *in.second;
+                                       },
+                                       joined)
+                               .value());
+            id++;
+        }
+        level = std::move(next);
+    }
+
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << kBranches << "-way fan-out, " << threads << " threads\n";
+    for (auto [policy, name] :
+         {std::pair{SchedulerPolicy::GlobalQueue, "global queue "},
+          std::pair{SchedulerPolicy::WorkStealing, "work stealing"},
+          std::pair{SchedulerPolicy::CriticalPath, "critical path"}}) {
+        Executor executor(threads, policy);
+        p.run(level[0], executor).value();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kIterations; i++) {
+            p.run(level[0], executor).value();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "  " << name << ": "
+                  << std::chrono::duration<double, std::micro>(elapsed)
+                             .count() /
+                         kIterations
+                  << " us/run\n";
+    }
+}
@@ -0,0 +1,89 @@
+#include "pipeline_builder.hpp"
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+using namespace pipeline;
+
+// Measures the per-stage overhead of small payloads: heap allocations and
+// time per stage along a chain of trivial stages. Every other stage is
+// placed on another execution class so that no stage is fused and every
+// value passes through the Context. Per-stage figures are the difference
+// between two chain lengths, which cancels the fixed cost of a run.
+
+static std::atomic<size_t> allocations = 0;
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+constexpr int kShort = 32;
+constexpr int kLong = 64;
+constexpr int kIterations = 2000;
+
+// Larger than the small-object buffer of std::any
+using Wide = std::array<double, 4>;
+
+template <class T> T step(const T &x) {
+    T next = x;
+    next[0] += 1;
+    return next;
+}
+template <> int step(const int &x) { return x + 1; }
+
+struct Sample {
+    double allocations;
+    double nanos;
+};
+
+template <class T> Sample per_run(int length, Executor &executor) {
+    Pipeline p;
+    Port<T> port = p.add_stage("stage0", [] { return T{}; }).value();
+    for (int i = 1; i < length; i++) {
+        port = p.add_stage("stage" + std::to_string(i), step<T>, port).value();
+        if (i % 2 == 1) {
+            p.place(port, ExecutionClass::named("other")).value();
+        }
+    }
+    ExecutorSet executors(executor);
+    // Warm up, compiling the plan
+    for (int i = 0; i < kIterations / 10; i++) {
+        p.run(port, executors).value();
+    }
+    size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        p.run(port, executors).value();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return {static_cast<double>(allocations.load() - before) / kIterations,
+            std::chrono::duration<double, std::nano>(elapsed).count() /
+                kIterations};
+}
+
+template <class T> void report(const char *name, Executor &executor) {
+    Sample short_chain = per_run<T>(kShort, executor);
+    Sample long_chain = per_run<T>(kLong, executor);
+    std::cout << "  " << name << ": "
+              << (long_chain.allocations - short_chain.allocations) /
+                     (kLong - kShort)
+              << " allocations/stage, "
+              << (long_chain.nanos - short_chain.nanos) / (kLong - kShort)
+              << " ns/stage, " << short_chain.allocations << " allocations/run"
+              << " at " << kShort << " stages\n";
+}
+
+int main() {
+    Executor executor(1);
+    std::cout << "Chains of " << kShort << " and " << kLong
+              << " unfused stages, 1 thread\n";
+    report<int>("int                  ", executor);
+    report<Wide>("std::array<double, 4>", executor);
+}
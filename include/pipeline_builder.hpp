@@ -1,33 +1,62 @@
 #pragma once
 
-#include <any>
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <concepts>
 #include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
 #include <expected>
+#include <filesystem>
 #include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <ios>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <memory>
+#include <memory_resource>
 #include <mutex>
 #include <optional>
 #include <queue>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <stop_token>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <variant>
 #include <vector>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace pipeline {
 
 using Key = std::string;
-using Value = std::any;
-struct Context {
-    std::mutex mut;
-    std::unordered_map<Key, Value> stage_results;
-};
+// Dense index of a stage within its pipeline, assigned in creation order
+using StageId = size_t;
 
 enum class Error {
     StageAlreadyExists,
@@ -38,6 +67,8 @@ enum class Error {
     RuntimeError,
     InvalidThreadCount,
     MixingStagesAcrossPipelines,
+    ResultNotAvailable,
+    NotASource,
 };
 
 std::ostream &operator<<(std::ostream &os, Error e) {
@@ -58,6 +89,10 @@ std::ostream &operator<<(std::ostream &os, Error e) {
         return os << "InvalidThreadCount";
     case Error::MixingStagesAcrossPipelines:
         return os << "MixingStagesAcrossPipelines";
+    case Error::ResultNotAvailable:
+        return os << "ResultNotAvailable";
+    case Error::NotASource:
+        return os << "NotASource";
     }
     return os << "UnknownError";
 }
@@ -65,403 +100,3979 @@ std::ostream &operator<<(std::ostream &os, Error e) {
 template <class T> using Result = std::expected<T, Error>;
 using Status = Result<std::monostate>;
 
-class Pipeline;
+// Bytes a value keeps resident, including the heap storage of standard
+// containers. Types owning other heap memory may provide an overload found
+// by argument dependent lookup
+template <class T> size_t resident_bytes(const T &) { return sizeof(T); }
 
-template <class T> class Port {
-  private:
-    const Pipeline *owner;
-    Key id;
-    // Only Pipeline class may create Ports
-    Port(const Pipeline *owner, Key id) : owner(owner), id(std::move(id)) {}
-    friend class Pipeline;
-    const Pipeline *get_owner() const { return owner; }
+inline size_t resident_bytes(const std::string &value) {
+    return sizeof(value) + value.capacity();
+}
 
-  public:
-    const Key &get_id() const { return id; }
-};
+template <class T, class A>
+size_t resident_bytes(const std::vector<T, A> &value) {
+    return sizeof(value) + value.capacity() * sizeof(T);
+}
 
-class IStage {
-  public:
-    virtual ~IStage() = default;
-    virtual Key stage_key() const = 0;
-    virtual void run(Context &context) = 0;
-};
+template <class T1, class T2>
+size_t resident_bytes(const std::pair<T1, T2> &value) {
+    return resident_bytes(value.first) + resident_bytes(value.second);
+}
 
-template <class Out, class F> class Stage0 final : public IStage {
+// Address unique to each type, identifying the type of a stored value
+// without RTTI
+template <class T> inline constexpr char type_tag = 0;
+
+// Maps StageIds onto dense positions 0, 1, ... in insertion order. Open
+// addressing keeps it proportional to the number of stages inserted, however
+// large the graph they belong to
+class StageIndex {
   private:
-    Key stage;
-    F func;
+    static constexpr StageId empty = std::numeric_limits<StageId>::max();
+    // StageId and position of each occupied bucket
+    std::vector<std::pair<StageId, size_t>> buckets;
+    size_t count = 0;
+    int shift = 64;
+    // Position of each id from `base` on, used instead of the buckets while
+    // the ids are close together
+    std::vector<size_t> table;
+    StageId base = 0;
+
+    // Fibonacci hashing spreads consecutive ids over the buckets
+    size_t bucket_of(StageId stage) const {
+        return static_cast<size_t>(
+            (static_cast<uint64_t>(stage) * 0x9E3779B97F4A7C15ull) >> shift);
+    }
+
+    void place(StageId stage, size_t position) {
+        size_t mask = buckets.size() - 1;
+        size_t i = bucket_of(stage);
+        while (buckets[i].first != empty) {
+            i = (i + 1) & mask;
+        }
+        buckets[i] = {stage, position};
+    }
+
+    void grow() {
+        std::vector<std::pair<StageId, size_t>> old = std::move(buckets);
+        size_t capacity = std::max<size_t>(old.size() * 2, 8);
+        buckets.assign(capacity, {empty, 0});
+        shift = 64 - std::countr_zero(capacity);
+        for (const auto &[stage, position] : old) {
+            if (stage != empty) {
+                place(stage, position);
+            }
+        }
+    }
+
+    void spread() {
+        std::vector<size_t> positions = std::move(table);
+        table.clear();
+        size_t capacity = std::bit_ceil(std::max<size_t>(count * 2, 8));
+        buckets.assign(capacity, {empty, 0});
+        shift = 64 - std::countr_zero(capacity);
+        for (size_t i = 0; i < positions.size(); i++) {
+            if (positions[i] != npos) {
+                place(base + i, positions[i]);
+            }
+        }
+    }
 
   public:
-    Stage0(Key stage, F func)
-        : stage(std::move(stage)), func(std::forward<F>(func)) {}
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
 
-    Key stage_key() const override { return stage; }
-    void run(Context &context) override {
-        Out result = std::invoke(func);
-        {
-            std::lock_guard<std::mutex> lg(context.mut);
-            context.stage_results[stage] = std::move(result);
+    StageIndex() = default;
+    // Positions of distinct `stages` in order. Ids spanning less than twice
+    // their number are looked up directly in a table over that span
+    explicit StageIndex(std::span<const StageId> stages) {
+        if (stages.empty()) {
+            return;
+        }
+        auto [lo, hi] = std::minmax_element(stages.begin(), stages.end());
+        if (*hi - *lo >= 2 * stages.size()) {
+            for (StageId stage : stages) {
+                insert(stage);
+            }
+            return;
+        }
+        base = *lo;
+        table.assign(*hi - *lo + 1, npos);
+        for (StageId stage : stages) {
+            table[stage - base] = count++;
+        }
+    }
+
+    size_t size() const { return count; }
+
+    // Position of `stage`, appended if it was not in the index yet
+    size_t insert(StageId stage) {
+        size_t found = find(stage);
+        if (found != npos) {
+            return found;
+        }
+        if (!table.empty()) {
+            spread();
+        }
+        if ((count + 1) * 2 > buckets.size()) {
+            grow();
+        }
+        place(stage, count);
+        return count++;
+    }
+
+    size_t find(StageId stage) const {
+        if (!table.empty()) {
+            return stage >= base && stage - base < table.size()
+                       ? table[stage - base]
+                       : npos;
+        }
+        if (buckets.empty()) {
+            return npos;
+        }
+        size_t mask = buckets.size() - 1;
+        for (size_t i = bucket_of(stage);; i = (i + 1) & mask) {
+            if (buckets[i].first == stage) {
+                return buckets[i].second;
+            }
+            if (buckets[i].first == empty) {
+                return npos;
+            }
         }
     }
 };
 
-template <class Out, class In, class F> class Stage1 final : public IStage {
+// Where each slot of a run keeps its value, laid out by the plan from the
+// output types of its stages
+struct StorageLayout {
+    static constexpr size_t none = static_cast<size_t>(-1);
+    // Offset of each slot within the storage block of a run, or none for
+    // slots whose value is allocated when published
+    std::vector<size_t> offsets;
+    std::vector<size_t> capacities;
+    size_t bytes = 0;
+    // Slot of each stage whose output is stored. Null when slots are
+    // indexed by StageId directly
+    std::shared_ptr<const StageIndex> index;
+};
+
+// Memory resource owned by a run. Stages which opt in allocate their
+// outputs from it by bumping a pointer, and everything is freed at once
+// when the run is discarded. Safe to allocate from concurrently
+class RunArena : public std::pmr::memory_resource {
   private:
-    Key stage;
-    F func;
-    Key dep;
+    std::mutex mut;
+    // Initial buffer, grown to the footprint of the previous run so that a
+    // reused arena bumps through a single block
+    std::unique_ptr<std::max_align_t[]> block;
+    size_t block_bytes = 0;
+    std::optional<std::pmr::monotonic_buffer_resource> chunks;
+    size_t used = 0;
+
+    void *do_allocate(size_t bytes, size_t align) override {
+        std::lock_guard<std::mutex> lg(mut);
+        // Counting the worst case padding keeps the grown block sufficient
+        used += bytes + align - 1;
+        return chunks->allocate(bytes, align);
+    }
+    // Monotonic: memory is only reclaimed by reset()
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+        return this == &other;
+    }
 
   public:
-    Stage1(Key stage, Key input, F func)
-        : stage(std::move(stage)), dep(std::move(input)),
-          func(std::forward<F>(func)) {}
+    RunArena() { chunks.emplace(std::pmr::new_delete_resource()); }
 
-    Key stage_key() const override { return stage; }
-    void run(Context &context) override {
-        In input;
-        {
-            std::lock_guard<std::mutex> lg(context.mut);
-            try {
-                // A stage may not mutate the input within Context, since other stages may read the same input.
-                input =
-                    std::any_cast<const In &>(context.stage_results.at(dep));
-            } catch (const std::bad_any_cast &) {
-                // Should not happen, since type checking is done via Ports within add_stages
-                throw Error::TypeMismatch;
-            }
-        }
-        Out result = std::invoke(func, input);
-        {
-            std::lock_guard<std::mutex> lg(context.mut);
-            context.stage_results[stage] = std::move(result);
+    // Bytes handed out since the last reset, including alignment padding
+    size_t allocated_bytes() {
+        std::lock_guard<std::mutex> lg(mut);
+        return used;
+    }
+    size_t capacity() const { return block_bytes; }
+
+    // Frees everything allocated, keeping a block large enough to serve the
+    // same allocations again without touching the heap
+    void reset() {
+        std::lock_guard<std::mutex> lg(mut);
+        chunks->release();
+        if (used > block_bytes) {
+            size_t blocks = (used + sizeof(std::max_align_t) - 1) /
+                            sizeof(std::max_align_t);
+            block.reset(new std::max_align_t[blocks]);
+            block_bytes = blocks * sizeof(std::max_align_t);
+            chunks.emplace(block.get(), block_bytes,
+                           std::pmr::new_delete_resource());
         }
+        used = 0;
     }
 };
 
-template <class In1, class In2> class JoinStage final : public IStage {
+// Arenas of finished runs, kept for reuse by later runs
+class ArenaPool : public std::enable_shared_from_this<ArenaPool> {
   private:
-    Key stage;
-    Key in1, in2;
+    std::mutex mut;
+    std::vector<std::unique_ptr<RunArena>> spare;
+    size_t max_spare;
+    size_t max_arena_bytes;
 
   public:
-    JoinStage(Key stage, Key in1, Key in2)
-        : stage(std::move(stage)), in1(std::move(in1)), in2(std::move(in2)) {}
+    // At most `max_spare` arenas are kept. Arenas which grew past
+    // `max_arena_bytes` are freed, so that one large run does not pin its
+    // footprint for as long as the pool lives
+    explicit ArenaPool(size_t max_spare = 8,
+                       size_t max_arena_bytes = size_t(64) << 20)
+        : max_spare(max_spare), max_arena_bytes(max_arena_bytes) {}
 
-    Key stage_key() const override { return stage; }
+    // Arenas currently kept for reuse
+    size_t size() {
+        std::lock_guard<std::mutex> lg(mut);
+        return spare.size();
+    }
 
-    void run(Context &context) override {
-        In1 input1;
-        In2 input2;
+    // The arena is reset and returned to the pool once its last user is
+    // gone, or freed if the pool is gone or full by then
+    std::shared_ptr<RunArena> acquire() {
+        std::unique_ptr<RunArena> arena;
         {
-            std::lock_guard<std::mutex> lg(context.mut);
-            try {
-                input1 =
-                    std::any_cast<const In1 &>(context.stage_results.at(in1));
-                input2 =
-                    std::any_cast<const In2 &>(context.stage_results.at(in2));
-            } catch (const std::bad_any_cast &) {
-                throw Error::TypeMismatch;
+            std::lock_guard<std::mutex> lg(mut);
+            if (!spare.empty()) {
+                arena = std::move(spare.back());
+                spare.pop_back();
             }
         }
-        std::pair<In1, In2> out{input1, input2};
-        {
-            std::lock_guard<std::mutex> lg(context.mut);
-            context.stage_results[stage] = out;
+        if (!arena) {
+            arena = std::make_unique<RunArena>();
         }
+        std::weak_ptr<ArenaPool> pool = weak_from_this();
+        return std::shared_ptr<RunArena>(
+            arena.release(), [pool](RunArena *released) {
+                std::unique_ptr<RunArena> owned(released);
+                std::shared_ptr<ArenaPool> alive = pool.lock();
+                // Checked before the reset, which would grow the block to
+                // the footprint of the run
+                if (!alive ||
+                    owned->allocated_bytes() > alive->max_arena_bytes) {
+                    return;
+                }
+                owned->reset();
+                std::lock_guard<std::mutex> lg(alive->mut);
+                if (alive->spare.size() < alive->max_spare) {
+                    alive->spare.push_back(std::move(owned));
+                }
+            });
     }
 };
 
-class Pipeline {
+// Allocator of the run a stage belongs to. Stages opt in by taking it as
+// their last parameter, e.g. to build std::pmr containers in the arena
+using RunAllocator = std::pmr::polymorphic_allocator<std::byte>;
+
+// Read-only view of a whole file, memory mapped where available
+class MappedFile {
   private:
-    std::unordered_map<Key, std::unique_ptr<IStage>> stages;
-    std::unordered_map<Key, std::vector<Key>> downstream_edges;
-    std::unordered_map<Key, std::vector<Key>> upstream_edges;
-    std::unordered_map<Key, int> in_degree;
-    Context context;
-
-    Result<std::unordered_set<Key>> get_all_upstream_stages(const Key &key) {
-        std::unordered_set<Key> graph;
-        std::queue<Key> frontier;
-        frontier.push(key);
-        graph.insert(key);
-        while (!frontier.empty()) {
-            Key curr = frontier.front();
-            frontier.pop();
-
-            if (!upstream_edges.contains(curr)) {
-                return std::unexpected(Error::UnknownStage);
-            }
-
-            for (const auto &neighbor : upstream_edges.at(curr)) {
-                if (!graph.contains(neighbor)) {
-                    graph.insert(neighbor);
-                    frontier.push(neighbor);
+    const std::byte *data = nullptr;
+    size_t length = 0;
+    // Fallback when the file cannot be mapped
+    std::vector<std::byte> buffer;
+    bool mapped = false;
+
+  public:
+    explicit MappedFile(const std::string &path) {
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            struct stat info;
+            if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+                void *p = ::mmap(nullptr, static_cast<size_t>(info.st_size),
+                                 PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = static_cast<const std::byte *>(p);
+                    length = static_cast<size_t>(info.st_size);
+                    mapped = true;
                 }
             }
+            ::close(fd);
+            if (mapped) {
+                return;
+            }
         }
-        return graph;
+#endif
+        std::ifstream f(path, std::ios::binary);
+        if (!f) {
+            throw Error::IoError;
+        }
+        f.seekg(0, std::ios::end);
+        buffer.resize(static_cast<size_t>(f.tellg()));
+        f.seekg(0);
+        if (!f.read(reinterpret_cast<char *>(buffer.data()),
+                    static_cast<std::streamsize>(buffer.size()))) {
+            throw Error::IoError;
+        }
+        data = buffer.data();
+        length = buffer.size();
     }
 
-  public:
-    Pipeline() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
 
-    template <class F>
-        requires std::invocable<F>
-    auto add_stage(Key id, F &&func) -> Result<Port<std::invoke_result_t<F>>> {
-        using Out = std::invoke_result_t<F>;
-        if (stages.contains(id)) {
-            return std::unexpected(Error::StageAlreadyExists);
+    ~MappedFile() {
+#ifdef __linux__
+        if (mapped) {
+            ::munmap(const_cast<std::byte *>(data), length);
         }
-        std::unique_ptr<IStage> stage_ptr =
-            std::make_unique<Stage0<Out, std::decay_t<F>>>(
-                id, std::forward<F>(func));
-        stages.emplace(id, std::move(stage_ptr));
-        downstream_edges.try_emplace(id);
-        upstream_edges.try_emplace(id);
-        in_degree.try_emplace(id, 0);
-        return Port<Out>{this, id};
+#endif
     }
 
-    template <class In, class F>
-        requires std::invocable<F, const In &>
-    auto add_stage(Key id, F &&func, const Port<In> &upstream)
-        -> Result<Port<std::invoke_result_t<F, const In &>>> {
-        using Out = std::invoke_result_t<F, const In &>;
-        if (upstream.get_owner() != this) {
-            // This error prevents silent collisions of stage ids across
-            // pipelines
-            return std::unexpected(Error::MixingStagesAcrossPipelines);
-        }
-        if (stages.contains(id)) {
-            return std::unexpected(Error::StageAlreadyExists);
+    std::span<const std::byte> bytes() const { return {data, length}; }
+};
+
+// Immutable bytes with shared ownership. Copies and slices are O(1) and
+// share the underlying storage, which may be heap memory or a mapped file
+class ByteBuffer {
+  private:
+    // Keeps the viewed bytes alive
+    std::shared_ptr<const void> owner;
+    const std::uint8_t *start = nullptr;
+    size_t length = 0;
+
+    template <class Container> static ByteBuffer adopt(Container bytes) {
+        auto stored = std::make_shared<const Container>(std::move(bytes));
+        std::span<const std::uint8_t> view(
+            reinterpret_cast<const std::uint8_t *>(stored->data()),
+            stored->size());
+        return ByteBuffer(std::move(stored), view);
+    }
+
+  public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    ByteBuffer() = default;
+    explicit ByteBuffer(std::vector<std::uint8_t> bytes)
+        : ByteBuffer(adopt(std::move(bytes))) {}
+    explicit ByteBuffer(std::string bytes)
+        : ByteBuffer(adopt(std::move(bytes))) {}
+    // Views bytes kept alive by `owner`, such as a mapped file
+    ByteBuffer(std::shared_ptr<const void> owner,
+               std::span<const std::uint8_t> bytes)
+        : owner(std::move(owner)), start(bytes.data()),
+          length(bytes.size()) {}
+
+    // Contents of a file, read into one allocation. Throws Error::IoError,
+    // for use within stages
+    static ByteBuffer read_file(const std::string &path) {
+        std::ifstream f(path, std::ios::binary | std::ios::ate);
+        if (!f) {
+            throw Error::IoError;
         }
-        if (!stages.contains(upstream.id)) {
-            return std::unexpected(Error::UnknownStage);
+        std::vector<std::uint8_t> bytes(static_cast<size_t>(f.tellg()));
+        f.seekg(0);
+        if (!f.read(reinterpret_cast<char *>(bytes.data()),
+                    static_cast<std::streamsize>(bytes.size()))) {
+            throw Error::IoError;
         }
-        std::unique_ptr<IStage> stage_ptr =
-            std::make_unique<Stage1<Out, In, std::decay_t<F>>>(
-                id, upstream.id, std::forward<F>(func));
+        return ByteBuffer(std::move(bytes));
+    }
 
-        stages.emplace(id, std::move(stage_ptr));
-        downstream_edges.try_emplace(id);
-        upstream_edges.try_emplace(id);
-        in_degree.try_emplace(id, 0);
+    // Contents of a file, memory mapped where available. The file must not
+    // be truncated while buffers of it are alive. Throws Error::IoError
+    static ByteBuffer map_file(const std::string &path) {
+        auto file = std::make_shared<const MappedFile>(path);
+        std::span<const std::byte> bytes = file->bytes();
+        return ByteBuffer(
+            std::move(file),
+            {reinterpret_cast<const std::uint8_t *>(bytes.data()),
+             bytes.size()});
+    }
 
-        downstream_edges.at(upstream.id).push_back(id);
-        upstream_edges.at(id).push_back(upstream.id);
-        in_degree.at(id)++;
+    const std::uint8_t *data() const { return start; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const std::uint8_t *begin() const { return start; }
+    const std::uint8_t *end() const { return start + length; }
+    std::uint8_t operator[](size_t i) const { return start[i]; }
 
-        return Port<Out>{this, id};
+    std::span<const std::uint8_t> span() const { return {start, length}; }
+    std::string_view view() const {
+        return {reinterpret_cast<const char *>(start), length};
     }
 
-    Result<Port<std::monostate>>
-    write_bytes_to_file(Key id, const std::string &path,
-                        const Port<std::vector<std::uint8_t>> &bytes_input) {
-        if (bytes_input.get_owner() != this) {
-            return std::unexpected(Error::MixingStagesAcrossPipelines);
-        }
-        if (stages.contains(id)) {
-            return std::unexpected(Error::StageAlreadyExists);
+    // Up to `count` bytes from `offset`, sharing this buffer's storage.
+    // Throws std::out_of_range if offset is past the end
+    ByteBuffer slice(size_t offset, size_t count = npos) const {
+        if (offset > length) {
+            throw std::out_of_range("ByteBuffer::slice");
         }
+        return ByteBuffer(owner,
+                          {start + offset, std::min(count, length - offset)});
+    }
 
-        return add_stage(
-            std::move(id),
-            [path](const std::vector<std::uint8_t> &data) {
-                std::ofstream f(path, std::ios::binary);
-                if (!f || !f.write(reinterpret_cast<const char *>(data.data()),
-                                   static_cast<std::streamsize>(data.size()))) {
-                    throw Error::IoError;
-                }
-                return std::monostate{};
-            },
-            bytes_input);
+    friend bool operator==(const ByteBuffer &a, const ByteBuffer &b) {
+        return std::ranges::equal(a.span(), b.span());
     }
+};
 
-    Result<Port<std::vector<std::uint8_t>>> read_bytes_from_file(
-        Key id, const std::string &path,
-        std::optional<Port<std::monostate>> after = std::nullopt) {
-        if (after.has_value() && after.value().get_owner() != this) {
-            return std::unexpected(Error::MixingStagesAcrossPipelines);
+// Shared storage is counted by every buffer viewing it
+inline size_t resident_bytes(const ByteBuffer &value) {
+    return sizeof(value) + value.size();
+}
+
+// Identity and modification time of a file, which change whenever the file
+// is written or replaced
+struct FileStamp {
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+    // Modified so recently that a later write may keep the same mtime, in
+    // which case the stamp cannot tell the two contents apart
+    bool recent = false;
+
+    bool operator==(const FileStamp &other) const {
+        return device == other.device && inode == other.inode &&
+               size == other.size && mtime_ns == other.mtime_ns;
+    }
+
+    // Null if the file cannot be stat'ed
+    static std::optional<FileStamp> of(const std::string &path) {
+        // Wider than the timestamp granularity of common file systems
+        constexpr std::int64_t racy_ns = 1'000'000'000;
+        FileStamp stamp;
+#ifdef __linux__
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0) {
+            return std::nullopt;
         }
-        if (stages.contains(id)) {
-            return std::unexpected(Error::StageAlreadyExists);
+        stamp.device = info.st_dev;
+        stamp.inode = info.st_ino;
+        stamp.size = static_cast<std::uint64_t>(info.st_size);
+        stamp.mtime_ns = info.st_mtim.tv_sec * 1'000'000'000LL +
+                         info.st_mtim.tv_nsec;
+        std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::system_clock::now()
+                                   .time_since_epoch())
+                               .count();
+#else
+        std::error_code ec;
+        stamp.size = std::filesystem::file_size(path, ec);
+        auto mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) {
+            return std::nullopt;
         }
+        stamp.mtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             mtime.time_since_epoch())
+                             .count();
+        std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::filesystem::file_time_type::clock::now()
+                                   .time_since_epoch())
+                               .count();
+#endif
+        stamp.recent = stamp.mtime_ns > now - racy_ns;
+        return stamp;
+    }
+};
 
-        if (after.has_value()) {
-            return add_stage(
-                std::move(id),
-                [path](std::monostate) -> std::vector<std::uint8_t> {
-                    std::ifstream f(path, std::ios::binary);
-                    if (!f) {
-                        throw Error::IoError;
-                    }
-                    return std::vector<std::uint8_t>{
-                        std::istreambuf_iterator<char>(f),
-                        std::istreambuf_iterator<char>()};
-                },
-                after.value());
+// Contents of a file, kept and handed out again for as long as the file's
+// stamp shows it unchanged
+class FileSource {
+  private:
+    std::string path;
+    mutable std::mutex mut;
+    // Null until the file was read, and while a recent write could still
+    // change it without changing the stamp
+    std::optional<FileStamp> stamp;
+    ByteBuffer bytes;
+
+  public:
+    explicit FileSource(std::string path) : path(std::move(path)) {}
+
+    const std::string &get_path() const { return path; }
+
+    // Throws Error::IoError, for use within stages
+    ByteBuffer read() {
+        // Taken before reading, so a write racing the read changes the
+        // stamp and the file is read again next time
+        std::optional<FileStamp> current = FileStamp::of(path);
+        std::lock_guard<std::mutex> lg(mut);
+        if (current.has_value() && stamp == current) {
+            return bytes;
         }
+        bytes = ByteBuffer::read_file(path);
+        stamp = current.has_value() && !current->recent ? current
+                                                          : std::nullopt;
+        return bytes;
+    }
 
-        return add_stage(std::move(id), [path]() -> std::vector<std::uint8_t> {
-            std::ifstream f(path, std::ios::binary);
-            if (!f) {
-                throw Error::IoError;
+    // Whether the next read may return different bytes than the last one
+    bool changed() const {
+        std::optional<FileStamp> current = FileStamp::of(path);
+        std::lock_guard<std::mutex> lg(mut);
+        return !stamp.has_value() || stamp != current;
+    }
+};
+
+// Wakes up when a file in the directories of the given files may have
+// changed. Uses inotify on Linux, elsewhere or when inotify is unavailable
+// every wait simply times out as if something changed
+class ChangeNotifier {
+  private:
+    int fd = -1;
+
+  public:
+    explicit ChangeNotifier(const std::vector<std::string> &paths) {
+#ifdef __linux__
+        fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        for (const std::string &path : paths) {
+            if (fd < 0) {
+                return;
             }
-            return std::vector<std::uint8_t>{std::istreambuf_iterator<char>(f),
-                                             std::istreambuf_iterator<char>()};
-        });
+            // Editors often replace a file by renaming over it, which only
+            // a watch on its directory sees
+            std::filesystem::path dir =
+                std::filesystem::path(path).parent_path();
+            if (dir.empty()) {
+                dir = ".";
+            }
+            if (::inotify_add_watch(fd, dir.c_str(),
+                                    IN_CLOSE_WRITE | IN_MOVED_TO |
+                                        IN_MOVED_FROM | IN_DELETE |
+                                        IN_ATTRIB) < 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+#endif
     }
 
-    template <class In1, class In2>
-    Result<Port<std::pair<In1, In2>>> join(Key id, Port<In1> in1,
-                                           Port<In2> in2) {
-        if (in1.get_owner() != this || in2.get_owner() != this) {
-            return std::unexpected(Error::MixingStagesAcrossPipelines);
+    ChangeNotifier(const ChangeNotifier &) = delete;
+    ChangeNotifier &operator=(const ChangeNotifier &) = delete;
+
+    ~ChangeNotifier() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ::close(fd);
         }
-        if (stages.contains(id)) {
-            return std::unexpected(Error::StageAlreadyExists);
+#endif
+    }
+
+    // Waits up to `timeout`, returns whether anything may have changed
+    bool wait(std::chrono::milliseconds timeout) {
+#ifdef __linux__
+        if (fd >= 0) {
+            pollfd ready{fd, POLLIN, 0};
+            if (::poll(&ready, 1, static_cast<int>(timeout.count())) <= 0) {
+                return false;
+            }
+            // Drains every pending event, so the writes of one save are
+            // handled together
+            alignas(inotify_event) char events[4096];
+            while (::read(fd, events, sizeof(events)) > 0) {
+            }
+            return true;
         }
-        if (!stages.contains(in1.id)) {
-            return std::unexpected(Error::UnknownStage);
+#endif
+        std::this_thread::sleep_for(timeout);
+        return true;
+    }
+};
+
+// Specialize to let values of a type be spilled to disk when a run exceeds
+// its memory budget:
+//   static void write(const T &value, std::ostream &out);
+//   static T read(std::span<const std::byte> bytes);
+template <class T> struct Serializer;
+
+template <class T>
+concept Serializable = requires(const T &value, std::ostream &out,
+                                std::span<const std::byte> bytes) {
+    Serializer<T>::write(value, out);
+    { Serializer<T>::read(bytes) } -> std::same_as<T>;
+};
+
+template <class T>
+    requires std::is_trivially_copyable_v<T>
+struct Serializer<std::vector<T>> {
+    static void write(const std::vector<T> &value, std::ostream &out) {
+        out.write(reinterpret_cast<const char *>(value.data()),
+                  static_cast<std::streamsize>(value.size() * sizeof(T)));
+    }
+    static std::vector<T> read(std::span<const std::byte> bytes) {
+        std::vector<T> value(bytes.size() / sizeof(T));
+        std::memcpy(value.data(), bytes.data(), value.size() * sizeof(T));
+        return value;
+    }
+};
+
+template <> struct Serializer<ByteBuffer> {
+    static void write(const ByteBuffer &value, std::ostream &out) {
+        out.write(value.view().data(),
+                  static_cast<std::streamsize>(value.size()));
+    }
+    static ByteBuffer read(std::span<const std::byte> bytes) {
+        const auto *begin =
+            reinterpret_cast<const std::uint8_t *>(bytes.data());
+        return ByteBuffer(
+            std::vector<std::uint8_t>(begin, begin + bytes.size()));
+    }
+};
+
+template <> struct Serializer<std::string> {
+    static void write(const std::string &value, std::ostream &out) {
+        out.write(value.data(), static_cast<std::streamsize>(value.size()));
+    }
+    static std::string read(std::span<const std::byte> bytes) {
+        return std::string(reinterpret_cast<const char *>(bytes.data()),
+                           bytes.size());
+    }
+};
+
+// 128-bit FNV-1a digest of serialized values, identifying stage outputs by
+// content
+struct ContentHash {
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    bool operator==(const ContentHash &other) const = default;
+
+    std::string hex() const {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string out(32, '0');
+        for (int i = 0; i < 16; i++) {
+            out[15 - i] = digits[(high >> (4 * i)) & 0xf];
+            out[31 - i] = digits[(low >> (4 * i)) & 0xf];
         }
-        if (!stages.contains(in2.id)) {
-            return std::unexpected(Error::UnknownStage);
+        return out;
+    }
+};
+
+// Hashes whatever is written to it, so values are hashed by streaming them
+// through their Serializer without buffering
+class ContentHasher : public std::streambuf {
+  private:
+    // High and low halves of the 128-bit state
+    uint64_t high = 0x6c62272e07bb0142;
+    uint64_t low = 0x62b821756295c58d;
+
+  protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            char byte = traits_type::to_char_type(c);
+            update({reinterpret_cast<const std::byte *>(&byte), 1});
         }
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        update({reinterpret_cast<const std::byte *>(s),
+                static_cast<size_t>(n)});
+        return n;
+    }
 
-        std::unique_ptr<IStage> stage_ptr =
-            std::make_unique<JoinStage<In1, In2>>(id, in1.id, in2.id);
+  public:
+    void update(std::span<const std::byte> bytes) {
+        // The prime is 2^88 + 0x13b, so the product modulo 2^128 is the
+        // state times 0x13b plus its low half shifted up by 88 bits
+        static constexpr uint64_t prime_low = 0x13b;
+        for (std::byte b : bytes) {
+            low ^= static_cast<uint8_t>(b);
+            uint64_t carry = ((low >> 32) * prime_low +
+                              ((low & 0xffffffff) * prime_low >> 32)) >>
+                             32;
+            high = high * prime_low + carry + (low << 24);
+            low *= prime_low;
+        }
+    }
+    void update(std::string_view text) {
+        update({reinterpret_cast<const std::byte *>(text.data()),
+                text.size()});
+    }
+    void update(const ContentHash &hash) {
+        update({reinterpret_cast<const std::byte *>(&hash), sizeof(hash)});
+    }
 
-        stages.emplace(id, std::move(stage_ptr));
-        downstream_edges.try_emplace(id);
-        upstream_edges.try_emplace(id);
-        in_degree.try_emplace(id, 0);
+    ContentHash digest() const {
+        return {high, low};
+    }
+};
 
-        downstream_edges.at(in1.id).push_back(id);
-        downstream_edges.at(in2.id).push_back(id);
-        in_degree.at(id) += 2;
+// Where pure stage outputs are persisted across processes
+struct DiskCacheOptions {
+    std::string directory;
+    // Least recently used entries are evicted once the cache holds more
+    size_t max_bytes = std::numeric_limits<size_t>::max();
+};
 
-        upstream_edges.at(id).push_back(in1.id);
-        upstream_edges.at(id).push_back(in2.id);
+// Serialized stage outputs stored under a hash of how they were computed.
+// Any number of processes may share a directory, entries are published by
+// renaming complete files into place
+class DiskCache {
+  private:
+    std::filesystem::path directory;
+    size_t max_bytes;
+    // Distinguishes temporary files of concurrent writers
+    uint64_t writer = std::random_device{}();
+    std::atomic<uint64_t> next_file = 0;
+    // Total size of the entries as of the last scan of the directory, plus
+    // what was stored since. Entries stored by other processes sharing the
+    // directory are only counted by a scan, which runs when the cache looks
+    // full and every rescan_interval stores
+    std::mutex mut;
+    std::optional<size_t> total;
+    size_t stores_since_scan = 0;
+    static constexpr size_t rescan_interval = 256;
 
-        return Port<std::pair<In1, In2>>(this, id);
+    // Lists entries from least to most recently used, and recounts their
+    // total size
+    std::vector<std::pair<std::filesystem::file_time_type,
+                          std::filesystem::path>>
+    scan() {
+        std::error_code ec;
+        std::vector<std::pair<std::filesystem::file_time_type,
+                              std::filesystem::path>>
+            entries;
+        size_t bytes = 0;
+        for (const auto &entry :
+             std::filesystem::directory_iterator(directory, ec)) {
+            if (!entry.is_regular_file(ec) ||
+                entry.path().extension() == ".tmp") {
+                continue;
+            }
+            // Skips entries evicted meanwhile
+            uintmax_t size = entry.file_size(ec);
+            if (ec) {
+                continue;
+            }
+            std::filesystem::file_time_type time = entry.last_write_time(ec);
+            if (ec) {
+                continue;
+            }
+            bytes += size;
+            entries.emplace_back(time, entry.path());
+        }
+        std::sort(entries.begin(), entries.end());
+        total = bytes;
+        stores_since_scan = 0;
+        return entries;
     }
 
-    template <class T>
-    Result<T> run(const Port<T> &stage, size_t num_threads = 1) {
-        if (stage.get_owner() != this) {
-            return std::unexpected(Error::MixingStagesAcrossPipelines);
+    // Accounts for `added` bytes in place of `replaced` ones, evicting the
+    // least recently used entries once over the limit. Evicts down to three
+    // quarters of the limit, so that a full cache is not scanned on every
+    // store
+    void account(size_t added, size_t replaced) {
+        std::lock_guard<std::mutex> lg(mut);
+        std::optional<decltype(scan())> entries;
+        if (!total.has_value() || ++stores_since_scan >= rescan_interval) {
+            entries = scan();
+        } else {
+            *total += added - std::min(replaced, *total);
         }
-        auto hc = std::thread::hardware_concurrency();
-        if (num_threads == 0 || (hc != 0 && num_threads > hc)) {
-            return std::unexpected(Error::InvalidThreadCount);
+        if (*total <= max_bytes) {
+            return;
+        }
+        if (!entries.has_value()) {
+            entries = scan();
+        }
+        size_t target = max_bytes - max_bytes / 4;
+        std::error_code ec;
+        for (const auto &[time, path] : *entries) {
+            if (*total <= target) {
+                break;
+            }
+            uintmax_t size = std::filesystem::file_size(path, ec);
+            if (!ec && std::filesystem::remove(path, ec)) {
+                *total -= std::min<size_t>(size, *total);
+            }
+        }
+    }
+
+  public:
+    explicit DiskCache(const DiskCacheOptions &options)
+        : directory(options.directory), max_bytes(options.max_bytes) {}
+
+    // The entry stored under `key`, if any. Found entries count as recently
+    // used
+    std::unique_ptr<MappedFile> find(const ContentHash &key) {
+        std::filesystem::path path = directory / key.hex();
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec)) {
+            return nullptr;
         }
-        context.stage_results.clear();
-        Result<std::unordered_set<Key>> upstream_stages_result =
-            get_all_upstream_stages(stage.id);
-        if (!upstream_stages_result.has_value()) {
-            return std::unexpected(upstream_stages_result.error());
+        std::filesystem::last_write_time(
+            path, std::filesystem::file_time_type::clock::now(), ec);
+        try {
+            return std::make_unique<MappedFile>(path.string());
+        } catch (Error) {
+            // Evicted meanwhile
+            return nullptr;
         }
+    }
 
-        std::unordered_set<Key> all_stages_to_run =
-            upstream_stages_result.value();
-        std::queue<Key> ready;
-        std::unordered_map<Key, int> indeg_for_run;
-        for (const auto &key : all_stages_to_run) {
-            indeg_for_run.emplace(key, in_degree.at(key));
-            if (indeg_for_run.at(key) == 0) {
-                ready.push(key);
+    // Stores what `write` writes under `key`. Failing to store an entry is
+    // not an error, the value is simply computed again next time
+    template <class Write> void store(const ContentHash &key, Write &&write) {
+        std::filesystem::path path = directory / key.hex();
+        std::filesystem::path tmp =
+            directory / (key.hex() + "-" + std::to_string(writer) + "-" +
+                         std::to_string(next_file++) + ".tmp");
+        std::error_code ec;
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            write(f);
+            f.close();
+            if (!f) {
+                std::filesystem::remove(tmp, ec);
+                return;
             }
         }
+        uintmax_t added = std::filesystem::file_size(tmp, ec);
+        if (ec) {
+            added = 0;
+        }
+        // Another writer may have stored the same entry meanwhile
+        uintmax_t replaced = std::filesystem::file_size(path, ec);
+        if (ec) {
+            replaced = 0;
+        }
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) {
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+        account(added, replaced);
+    }
+};
 
-        std::mutex mut;
-        std::condition_variable waiting_workers;
-        std::atomic<size_t> remaining_jobs = all_stages_to_run.size();
-        std::atomic<bool> failed = false;
-        Error err = Error::RuntimeError;
+// When a run spills stage outputs to disk
+struct SpillOptions {
+    // Bytes of stage outputs a run may hold before the least recently
+    // published values which are not being read are spilled
+    size_t memory_budget = std::numeric_limits<size_t>::max();
+    // Scratch directory for spilled values, which are deleted with the run
+    std::string directory = std::filesystem::temp_directory_path().string();
+};
 
-        std::vector<std::thread> threads;
-        for (int i = 0; i < num_threads; i++) {
-            threads.push_back(std::thread([&]() {
-                while (true) {
-                    Key curr;
-                    // Try to grab a stage from the queue
-                    {
-                        std::unique_lock<std::mutex> uniq(mut);
-                        // Wait for a job, unless pipeline has failed or succeeded
-                        waiting_workers.wait(uniq, [&] {
-                            return failed.load() || !ready.empty() ||
-                                   remaining_jobs.load() == 0;
-                        });
-
-                        if (failed.load() || remaining_jobs.load() == 0) {
-                            return;
-                        }
-                        curr = ready.front();
-                        ready.pop();
-                    }
+// Output of one stage within a run. Written once by the stage and only read
+// by stages which the DAG orders after it, so no lock is needed
+struct Slot {
+    // Inline storage reserved for the value, if any
+    void *storage = nullptr;
+    size_t capacity = 0;
+    // The constructed value, its type and how to destroy it
+    void *value = nullptr;
+    const void *type = nullptr;
+    void (*destroy)(void *) = nullptr;
+    std::atomic<bool> ready = false;
+    // Set when the value has a single consumer in the run, which may take
+    // it over instead of copying it
+    bool movable = false;
+    // Set when a join holds handles to the value. It is then published into
+    // a block of its own, owned by `shared` and by the handles
+    bool sharable = false;
+    std::shared_ptr<void> shared;
+    size_t bytes = 0;
 
-                    // Run the stage
-                    try {
-                        stages.at(curr)->run(context);
-                    } catch (Error e) {
-                        {
-                            std::lock_guard<std::mutex> lg(mut);
-                            err = e;
-                        }
-                        failed = true;
-                        waiting_workers.notify_all();
-                        return;
-                    } catch (const std::exception& e) {
-                        {
-                            std::lock_guard<std::mutex> lg(mut);
-                            err = Error::RuntimeError;
-                        }
-                        std::cerr << "Stage " << curr << " threw: " << e.what() << "\n";
-                        failed = true;
-                        waiting_workers.notify_all();
-                        return;
-                    }
+    // Guarded by the spill mutex of the Context. A spilled value stays
+    // published, but lives in its spill file until a consumer pins it
+    void (*write)(const void *, std::ostream &) = nullptr;
+    void (*reload)(Slot &, std::span<const std::byte>) = nullptr;
+    uint64_t published = 0;
+    int pins = 0;
+    bool spilled = false;
+};
 
-                    // Make downstream ready to run
-                    {
-                        std::lock_guard<std::mutex> lg(mut);
-                        for (const Key &downstream :
-                             downstream_edges.at(curr)) {
-                            if (all_stages_to_run.contains(downstream)) {
-                                indeg_for_run.at(downstream)--;
-                                if (indeg_for_run.at(downstream) == 0) {
-                                    ready.push(downstream);
-                                }
-                            }
-                        }
-                    }
+// Results of a single run, one slot per stored output of its plan. Values
+// are addressed by the StageId which produced them, and constructed in place
+// in one storage block allocated up front, so publishing a value of a type
+// known to the plan allocates nothing
+class Context {
+  private:
+    // Declared first, so that it outlives the values allocated from it
+    std::shared_ptr<RunArena> arena;
+    std::unique_ptr<Slot[]> slots;
+    size_t num_slots = 0;
+    // Slot of each stage, null when slots are indexed by StageId
+    std::shared_ptr<const StageIndex> index;
+    std::unique_ptr<std::max_align_t[]> storage;
+    std::atomic<size_t> resident = 0;
+    std::atomic<size_t> peak = 0;
 
-                    remaining_jobs.fetch_sub(1);
-                    waiting_workers.notify_all();
-                }
-            }));
+    std::optional<SpillOptions> spill_options;
+    mutable std::mutex spill_mut;
+    uint64_t next_publish = 0;
+    // Spill files of this run are named spill_prefix + slot
+    std::string spill_prefix;
+    std::atomic<size_t> spills = 0;
+    std::atomic<size_t> spilled_bytes = 0;
+    std::atomic<int64_t> spill_nanos = 0;
+    std::atomic<size_t> reloads = 0;
+    std::atomic<size_t> reloaded_bytes = 0;
+    std::atomic<int64_t> reload_nanos = 0;
+
+    void destroy(Slot &target) {
+        if (target.value != nullptr) {
+            target.destroy(target.value);
+            target.value = nullptr;
         }
+        target.shared.reset();
+    }
 
-        waiting_workers.notify_all();
-        for (auto &worker : threads) {
-            if (worker.joinable()) {
-                worker.join();
-            }
+    template <class Stored, class... Args>
+    static void construct(Slot &target, Args &&...args) {
+        bool fits = sizeof(Stored) <= target.capacity &&
+                    reinterpret_cast<std::uintptr_t>(target.storage) %
+                            alignof(Stored) ==
+                        0;
+        if (fits) {
+            target.value =
+                ::new (target.storage) Stored(std::forward<Args>(args)...);
+            target.destroy = [](void *p) {
+                static_cast<Stored *>(p)->~Stored();
+            };
+        } else {
+            target.value = new Stored(std::forward<Args>(args)...);
+            target.destroy = [](void *p) { delete static_cast<Stored *>(p); };
         }
+    }
 
-        if (failed.load()) {
-            return std::unexpected(err);
+    void count_resident(size_t bytes) {
+        size_t now = resident.fetch_add(bytes) + bytes;
+        size_t prev = peak.load(std::memory_order_relaxed);
+        while (prev < now && !peak.compare_exchange_weak(prev, now)) {
         }
+    }
 
-        try {
-            return std::any_cast<T>(context.stage_results.at(stage.id));
-        } catch (const std::bad_any_cast &) {
-            return std::unexpected(Error::TypeMismatch);
-        } catch (...) {
-            return std::unexpected(Error::UnknownStage);
+    size_t slot_of(StageId stage) const {
+        return index ? index->find(stage) : stage;
+    }
+
+    bool ready(size_t slot) const {
+        return slot < num_slots &&
+               slots[slot].ready.load(std::memory_order_acquire);
+    }
+
+    template <class T> const T &value_at(size_t slot) const {
+        if (!ready(slot) || slots[slot].value == nullptr) {
+            throw Error::RuntimeError;
         }
+        if (slots[slot].type != &type_tag<T>) {
+            // Should not happen, since type checking is done via Ports
+            // within add_stages
+            throw Error::TypeMismatch;
+        }
+        return *static_cast<const T *>(slots[slot].value);
+    }
+
+    std::string spill_path(size_t slot) const {
+        return spill_prefix + std::to_string(slot);
+    }
+
+    static void add_nanos(std::atomic<int64_t> &total,
+                          std::chrono::steady_clock::time_point start) {
+        total += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    }
+
+    // Spills the least recently published values nobody is reading until
+    // the run fits its budget again. Must be called with spill_mut held
+    void enforce_budget() {
+        while (resident.load() > spill_options->memory_budget) {
+            Slot *coldest = nullptr;
+            size_t coldest_slot = 0;
+            for (size_t slot = 0; slot < num_slots; slot++) {
+                Slot &candidate = slots[slot];
+                // Fields of unpublished slots may still be written to
+                if (!candidate.ready.load(std::memory_order_acquire) ||
+                    candidate.write == nullptr || candidate.spilled ||
+                    candidate.pins > 0 || candidate.value == nullptr) {
+                    continue;
+                }
+                if (coldest == nullptr ||
+                    candidate.published < coldest->published) {
+                    coldest = &candidate;
+                    coldest_slot = slot;
+                }
+            }
+            if (coldest == nullptr) {
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            std::string path = spill_path(coldest_slot);
+            std::ofstream f(path, std::ios::binary | std::ios::trunc);
+            coldest->write(coldest->value, f);
+            f.close();
+            if (!f) {
+                // Values which cannot be spilled stay in memory
+                std::error_code ignored;
+                std::filesystem::remove(path, ignored);
+                coldest->write = nullptr;
+                continue;
+            }
+            spills++;
+            spilled_bytes += coldest->bytes;
+            destroy(*coldest);
+            resident.fetch_sub(coldest->bytes);
+            coldest->spilled = true;
+            add_nanos(spill_nanos, start);
+        }
+    }
+
+  public:
+    Context() = default;
+    // Every value is allocated when published
+    explicit Context(size_t num_slots)
+        : slots(std::make_unique<Slot[]>(num_slots)), num_slots(num_slots) {}
+
+    // Slots with inline storage in the layout are carved out of `arena`, or
+    // out of a heap block without one
+    explicit Context(const StorageLayout &layout,
+                     std::shared_ptr<RunArena> run_arena = nullptr)
+        : Context(layout.offsets.size()) {
+        arena = std::move(run_arena);
+        index = layout.index;
+        std::byte *base;
+        if (arena) {
+            base = static_cast<std::byte *>(
+                arena->allocate(std::max<size_t>(layout.bytes, 1),
+                                alignof(std::max_align_t)));
+        } else {
+            size_t blocks = (layout.bytes + sizeof(std::max_align_t) - 1) /
+                            sizeof(std::max_align_t);
+            // Left uninitialized, values are constructed into it
+            storage.reset(new std::max_align_t[blocks]);
+            base = reinterpret_cast<std::byte *>(storage.get());
+        }
+        for (size_t slot = 0; slot < num_slots; slot++) {
+            if (layout.offsets[slot] != StorageLayout::none) {
+                slots[slot].storage = base + layout.offsets[slot];
+                slots[slot].capacity = layout.capacities[slot];
+            }
+        }
+    }
+
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    ~Context() {
+        for (size_t slot = 0; slot < num_slots; slot++) {
+            destroy(slots[slot]);
+            if (slots[slot].spilled) {
+                std::error_code ignored;
+                std::filesystem::remove(spill_path(slot), ignored);
+            }
+        }
+    }
+
+    size_t size() const { return num_slots; }
+
+    // Allocates from the arena of the run, or the default resource if the
+    // Context has none
+    RunAllocator allocator() const {
+        if (arena) {
+            return RunAllocator(arena.get());
+        }
+        return RunAllocator(std::pmr::get_default_resource());
+    }
+    size_t arena_bytes() const {
+        return arena ? arena->allocated_bytes() : 0;
+    }
+
+    // Values with a Serializer are spilled to disk whenever the run holds
+    // more than the budget
+    void enable_spilling(SpillOptions options) {
+        // Distinguishes processes sharing a spill directory, and the runs
+        // of this one
+        static const uint64_t process =
+            (uint64_t(std::random_device{}()) << 32) | std::random_device{}();
+        static std::atomic<uint64_t> next_id = 0;
+        spill_prefix = options.directory + "/pipeline-spill-" +
+                       std::to_string(process) + "-" +
+                       std::to_string(next_id++) + "-";
+        spill_options = std::move(options);
+    }
+    bool spilling() const { return spill_options.has_value(); }
+
+    template <class T> void publish(StageId stage, T &&value) {
+        using Stored = std::decay_t<T>;
+        Slot &target = slots[slot_of(stage)];
+        if (target.sharable) {
+            // Handles may outlive the run, so they also keep the arena the
+            // value may have allocated from
+            std::shared_ptr<Stored> block(
+                new Stored(std::forward<T>(value)),
+                [arena = arena](Stored *p) mutable {
+                    delete p;
+                    arena.reset();
+                });
+            target.value = block.get();
+            target.shared = std::move(block);
+            target.destroy = [](void *) {};
+        } else {
+            construct<Stored>(target, std::forward<T>(value));
+        }
+        target.type = &type_tag<Stored>;
+        target.bytes = resident_bytes(*static_cast<Stored *>(target.value));
+        count_resident(target.bytes);
+        // Shared values are not spilled, the handles keep them in memory
+        if constexpr (Serializable<Stored>) {
+            if (!target.sharable) {
+                target.write = [](const void *p, std::ostream &out) {
+                    Serializer<Stored>::write(
+                        *static_cast<const Stored *>(p), out);
+                };
+                target.reload = [](Slot &into,
+                                   std::span<const std::byte> bytes) {
+                    construct<Stored>(into, Serializer<Stored>::read(bytes));
+                };
+            }
+        }
+        if (!spill_options.has_value()) {
+            target.ready.store(true, std::memory_order_release);
+            return;
+        }
+        std::lock_guard<std::mutex> lg(spill_mut);
+        target.published = next_publish++;
+        target.ready.store(true, std::memory_order_release);
+        enforce_budget();
+    }
+
+    // Keeps the value of a stage in memory while a consumer reads it,
+    // reloading it first if it was spilled
+    void pin(StageId stage) {
+        std::lock_guard<std::mutex> lg(spill_mut);
+        size_t slot = slot_of(stage);
+        Slot &target = slots[slot];
+        target.pins++;
+        if (!target.spilled) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        {
+            MappedFile file(spill_path(slot));
+            target.reload(target, file.bytes());
+        }
+        std::error_code ignored;
+        std::filesystem::remove(spill_path(slot), ignored);
+        target.spilled = false;
+        reloads++;
+        reloaded_bytes += target.bytes;
+        count_resident(target.bytes);
+        add_nanos(reload_nanos, start);
+        enforce_budget();
+    }
+
+    void unpin(StageId stage) {
+        std::lock_guard<std::mutex> lg(spill_mut);
+        slots[slot_of(stage)].pins--;
+    }
+
+    // Destroys the value of a stage once no consumer needs it anymore
+    void release(StageId stage) {
+        std::unique_lock<std::mutex> lg(spill_mut, std::defer_lock);
+        if (spill_options.has_value()) {
+            lg.lock();
+        }
+        size_t slot = slot_of(stage);
+        Slot &target = slots[slot];
+        target.ready.store(false, std::memory_order_relaxed);
+        if (target.spilled) {
+            std::error_code ignored;
+            std::filesystem::remove(spill_path(slot), ignored);
+            target.spilled = false;
+            return;
+        }
+        destroy(target);
+        resident.fetch_sub(target.bytes);
+        target.bytes = 0;
+    }
+
+    // Bytes currently held by published values, and the most held at once
+    size_t held_bytes() const { return resident.load(); }
+    size_t peak_bytes() const { return peak.load(); }
+
+    size_t spill_count() const { return spills.load(); }
+    size_t spilled() const { return spilled_bytes.load(); }
+    std::chrono::nanoseconds spill_time() const {
+        return std::chrono::nanoseconds(spill_nanos.load());
+    }
+    size_t reload_count() const { return reloads.load(); }
+    size_t reloaded() const { return reloaded_bytes.load(); }
+    std::chrono::nanoseconds reload_time() const {
+        return std::chrono::nanoseconds(reload_nanos.load());
+    }
+
+    // Whether the stage published its value in this run
+    bool contains(StageId stage) const { return ready(slot_of(stage)); }
+
+    // Value of an upstream stage, which has finished before its consumers
+    // start. Consumers pin values which may have been spilled
+    template <class T> const T &get(StageId stage) const {
+        return value_at<T>(slot_of(stage));
+    }
+
+    // Copy of the value of a stage, read from its spill file if needed
+    template <class T> T copy(StageId stage) const {
+        size_t slot = slot_of(stage);
+        if (!ready(slot)) {
+            throw Error::RuntimeError;
+        }
+        if (slots[slot].type != &type_tag<T>) {
+            throw Error::TypeMismatch;
+        }
+        if constexpr (Serializable<T>) {
+            std::unique_lock<std::mutex> lg(spill_mut, std::defer_lock);
+            if (spill_options.has_value()) {
+                lg.lock();
+            }
+            if (slots[slot].spilled) {
+                MappedFile file(spill_path(slot));
+                return Serializer<T>::read(file.bytes());
+            }
+            return *static_cast<const T *>(slots[slot].value);
+        } else {
+            return *static_cast<const T *>(slots[slot].value);
+        }
+    }
+
+    void allow_move(StageId stage) { slots[slot_of(stage)].movable = true; }
+    void allow_sharing(StageId stage) {
+        slots[slot_of(stage)].sharable = true;
+    }
+
+    // Value of an upstream stage, owned by the caller. Moved out of the slot
+    // if the caller is its only consumer, copied otherwise
+    template <class T> T take(StageId stage) {
+        size_t slot = slot_of(stage);
+        const T &value = value_at<T>(slot);
+        if (!slots[slot].movable) {
+            return value;
+        }
+        // Taken values are no longer observable through the Context
+        slots[slot].ready.store(false, std::memory_order_relaxed);
+        return std::move(const_cast<T &>(value));
+    }
+
+    // Handle to the value of an upstream stage, which stays valid once the
+    // value is released. Values not published for sharing are taken over
+    // by the handle
+    template <class T> std::shared_ptr<const T> share(StageId stage) {
+        size_t slot = slot_of(stage);
+        value_at<T>(slot);
+        if (slots[slot].shared) {
+            return std::static_pointer_cast<const T>(slots[slot].shared);
+        }
+        return std::make_shared<const T>(take<T>(stage));
+    }
+};
+
+class Pipeline;
+
+template <class T> class Port {
+  private:
+    // Only compared against, never dereferenced
+    const Pipeline *owner;
+    StageId id;
+    // Shared with the Pipeline, so it outlives it if the Port does
+    std::shared_ptr<const Key> name;
+    // Only Pipeline class may create Ports
+    Port(const Pipeline *owner, StageId id, std::shared_ptr<const Key> name)
+        : owner(owner), id(id), name(std::move(name)) {}
+    friend class Pipeline;
+    const Pipeline *get_owner() const { return owner; }
+
+  public:
+    // Name the stage was added with
+    const Key &get_id() const { return *name; }
+    StageId stage_id() const { return id; }
+};
+
+class Executor;
+// Completion callback of an asynchronous stage, receiving the exception it
+// failed with, if any
+using Completion = std::function<void(std::exception_ptr)>;
+
+class IStage {
+  public:
+    virtual ~IStage() = default;
+    virtual void run(Context &context) = 0;
+    // Runs the stage as the head of a fused chain: the output is handed to
+    // the first stage of `chain` instead of being stored in the Context
+    virtual void run_fused(Context &context,
+                           std::span<IStage *const> chain) = 0;
+    // Whether the stage can take its input directly from a fused predecessor
+    virtual bool fusible() const { return false; }
+    // Whether the stage holds handles to its inputs, which are then
+    // published for sharing
+    virtual bool shares_inputs() const { return false; }
+    // Runs the stage on an input owned by a fused predecessor, which may be
+    // moved from. The output is stored, or handed on to the rest of the chain
+    virtual void consume(void * /*input*/, Context & /*context*/,
+                         std::span<IStage *const> /*rest*/) {
+        throw Error::RuntimeError;
+    }
+    // Asynchronous stages are started with run_async instead of run, and
+    // may suspend without blocking the worker
+    virtual bool asynchronous() const { return false; }
+    // `executor` runs the stage whenever it resumes, while blocking calls
+    // it offloads run on `blocking`, or on `executor` as well if null
+    virtual void run_async(Context & /*context*/, Executor & /*executor*/,
+                           Executor * /*blocking*/, Completion /*done*/) {
+        throw Error::RuntimeError;
+    }
+};
+
+// Stores the output of a stage, or passes it on to the next fused stage
+template <class Out>
+void emit(StageId id, Out &&result, Context &context,
+          std::span<IStage *const> chain) {
+    if (!chain.empty()) {
+        chain.front()->consume(&result, context, chain.subspan(1));
+        return;
+    }
+    context.publish(id, std::forward<Out>(result));
+}
+
+// Parameter types of a callable with a single, non-template call operator
+template <class F> struct callable_params {};
+template <class R, class... A> struct callable_params<R (*)(A...)> {
+    using type = std::tuple<A...>;
+};
+template <class R, class... A> struct callable_params<R (*)(A...) noexcept> {
+    using type = std::tuple<A...>;
+};
+template <class C, class R, class... A>
+struct callable_params<R (C::*)(A...)> {
+    using type = std::tuple<A...>;
+};
+template <class C, class R, class... A>
+struct callable_params<R (C::*)(A...) const> {
+    using type = std::tuple<A...>;
+};
+template <class C, class R, class... A>
+struct callable_params<R (C::*)(A...) noexcept> {
+    using type = std::tuple<A...>;
+};
+template <class C, class R, class... A>
+struct callable_params<R (C::*)(A...) const noexcept> {
+    using type = std::tuple<A...>;
+};
+template <class F>
+    requires requires { &F::operator(); }
+struct callable_params<F> : callable_params<decltype(&F::operator())> {};
+
+// Whether a callable takes the allocator of the run as its last parameter.
+// Only callables with known parameter types can opt in, so generic callables
+// are never probed with an extra argument
+template <class F>
+constexpr bool takes_allocator = [] {
+    if constexpr (requires { typename callable_params<F>::type; }) {
+        using Params = typename callable_params<F>::type;
+        if constexpr (std::tuple_size_v<Params> > 0) {
+            return std::is_same_v<
+                std::remove_cvref_t<std::tuple_element_t<
+                    std::tuple_size_v<Params> - 1, Params>>,
+                RunAllocator>;
+        }
+    }
+    return false;
+}();
+
+template <class F, class... Args> constexpr bool stage_invocable() {
+    if constexpr (takes_allocator<std::decay_t<F>>) {
+        return std::invocable<F, Args..., RunAllocator>;
+    } else {
+        return std::invocable<F, Args...>;
+    }
+}
+
+template <bool WithAllocator, class F, class... Args> struct stage_result {
+    using type = std::invoke_result_t<F, Args...>;
+};
+template <class F, class... Args> struct stage_result<true, F, Args...> {
+    using type = std::invoke_result_t<F, Args..., RunAllocator>;
+};
+// Output type of a stage callable invoked with its inputs
+template <class F, class... Args>
+using stage_result_t =
+    typename stage_result<takes_allocator<std::decay_t<F>>, F, Args...>::type;
+
+// Invokes a stage callable on its inputs, followed by the allocator of the
+// run for callables which take one
+template <class F, class... Args>
+decltype(auto) invoke_stage(F &func, Context &context, Args &&...args) {
+    if constexpr (takes_allocator<F>) {
+        return std::invoke(func, std::forward<Args>(args)...,
+                           context.allocator());
+    } else {
+        return std::invoke(func, std::forward<Args>(args)...);
+    }
+}
+
+// Whether a callable takes its input by value or by rvalue reference, in
+// which case stages hand it an owned input rather than the stored value
+template <class F, class In>
+constexpr bool takes_ownership = [] {
+    if constexpr (requires { typename callable_params<F>::type; }) {
+        using Params = typename callable_params<F>::type;
+        if constexpr (std::tuple_size_v<Params> > 0) {
+            using First = std::tuple_element_t<0, Params>;
+            return !std::is_reference_v<First> ||
+                   std::is_rvalue_reference_v<First>;
+        }
+    }
+    return !std::invocable<F &, const In &>;
+}();
+
+// Argument type of a single input callable: a const reference when it
+// accepts one, an rvalue otherwise
+template <class F, class In>
+using stage_input_t = std::conditional_t<stage_invocable<F, const In &>(),
+                                         const In &, In &&>;
+
+template <class Out, class F> class Stage0 final : public IStage {
+  private:
+    StageId id;
+    F func;
+
+  public:
+    Stage0(StageId id, F func) : id(id), func(std::forward<F>(func)) {}
+
+    void run(Context &context) override { run_fused(context, {}); }
+    void run_fused(Context &context, std::span<IStage *const> chain) override {
+        Out result = invoke_stage(func, context);
+        emit(id, std::move(result), context, chain);
+    }
+};
+
+template <class Out, class In, class F> class Stage1 final : public IStage {
+  private:
+    StageId id;
+    F func;
+    size_t dep;
+
+  public:
+    Stage1(StageId id, size_t input, F func)
+        : id(id), func(std::forward<F>(func)), dep(input) {}
+
+    void run(Context &context) override { run_fused(context, {}); }
+    void run_fused(Context &context, std::span<IStage *const> chain) override {
+        if constexpr (takes_ownership<F, In>) {
+            // Moved in when this stage is the only consumer of its input
+            Out result = invoke_stage(func, context, context.take<In>(dep));
+            emit(id, std::move(result), context, chain);
+        } else {
+            // The callable reads the stored upstream value in place. A stage
+            // may not mutate the input within Context, since other stages
+            // may read the same input.
+            Out result = invoke_stage(func, context, context.get<In>(dep));
+            emit(id, std::move(result), context, chain);
+        }
+    }
+
+    bool fusible() const override { return true; }
+    void consume(void *input, Context &context,
+                 std::span<IStage *const> rest) override {
+        // A fused predecessor hands over its output, no other stage reads it
+        In &owned = *static_cast<In *>(input);
+        if constexpr (stage_invocable<F &, In &&>()) {
+            Out result = invoke_stage(func, context, std::move(owned));
+            emit(id, std::move(result), context, rest);
+        } else {
+            Out result = invoke_stage(func, context, std::as_const(owned));
+            emit(id, std::move(result), context, rest);
+        }
+    }
+};
+
+// Output of a join: handles to both inputs, which are shared with their
+// other consumers rather than copied into the pair
+template <class In1, class In2>
+using Joined =
+    std::pair<std::shared_ptr<const In1>, std::shared_ptr<const In2>>;
+
+template <class In1, class In2> class JoinStage final : public IStage {
+  private:
+    StageId id;
+    size_t in1, in2;
+
+  public:
+    JoinStage(StageId id, size_t in1, size_t in2)
+        : id(id), in1(in1), in2(in2) {}
+
+    bool shares_inputs() const override { return true; }
+    void run(Context &context) override { run_fused(context, {}); }
+    void run_fused(Context &context, std::span<IStage *const> chain) override {
+        // The inputs stay where they were published, however many other
+        // consumers read them
+        Joined<In1, In2> out(context.share<In1>(in1),
+                             context.share<In2>(in2));
+        emit(id, std::move(out), context, chain);
+    }
+};
+
+// Stage with several inputs, which the callable reads in place from the
+// Context in the order of their ports
+template <class Out, class F, class... Ins>
+class StageN final : public IStage {
+  private:
+    StageId id;
+    F func;
+    std::array<size_t, sizeof...(Ins)> deps;
+
+    template <size_t... I>
+    Out invoke(Context &context, std::index_sequence<I...>) {
+        return invoke_stage(func, context, context.get<Ins>(deps[I])...);
+    }
+
+  public:
+    StageN(StageId id, std::array<size_t, sizeof...(Ins)> inputs, F func)
+        : id(id), func(std::forward<F>(func)), deps(inputs) {}
+
+    void run(Context &context) override { run_fused(context, {}); }
+    void run_fused(Context &context, std::span<IStage *const> chain) override {
+        Out result = invoke(context, std::index_sequence_for<Ins...>{});
+        emit(id, std::move(result), context, chain);
+    }
+};
+
+// Current value of a source stage, replaced between runs by set_source
+template <class T> struct SourceCell {
+    std::mutex mut;
+    T value;
+
+    explicit SourceCell(T value) : value(std::move(value)) {}
+};
+
+// Stage without inputs which outputs the current value of its cell
+template <class T> class SourceStage final : public IStage {
+  private:
+    StageId id;
+    std::shared_ptr<SourceCell<T>> cell;
+
+  public:
+    SourceStage(StageId id, std::shared_ptr<SourceCell<T>> cell)
+        : id(id), cell(std::move(cell)) {}
+
+    void run(Context &context) override { run_fused(context, {}); }
+    void run_fused(Context &context, std::span<IStage *const> chain) override {
+        std::unique_lock<std::mutex> lg(cell->mut);
+        T value = cell->value;
+        lg.unlock();
+        emit(id, std::move(value), context, chain);
+    }
+};
+
+// Stage which mutates its input in place and passes it on as its output.
+// The input is taken over when this stage is its only consumer, and copied
+// exactly once otherwise
+template <class T, class F> class InplaceStage final : public IStage {
+  private:
+    StageId id;
+    F func;
+    size_t dep;
+
+  public:
+    InplaceStage(StageId id, size_t input, F func)
+        : id(id), func(std::forward<F>(func)), dep(input) {}
+
+    void run(Context &context) override { run_fused(context, {}); }
+    void run_fused(Context &context, std::span<IStage *const> chain) override {
+        T value = context.take<T>(dep);
+        invoke_stage(func, context, value);
+        emit(id, std::move(value), context, chain);
+    }
+
+    bool fusible() const override { return true; }
+    void consume(void *input, Context &context,
+                 std::span<IStage *const> rest) override {
+        T &owned = *static_cast<T *>(input);
+        invoke_stage(func, context, owned);
+        emit(id, std::move(owned), context, rest);
+    }
+};
+
+// How an Executor distributes submitted tasks across its workers
+enum class SchedulerPolicy {
+    // One FIFO queue per NUMA node, shared by the workers of that node
+    GlobalQueue,
+    // One deque per worker: a worker pushes and pops its own tasks LIFO,
+    // idle workers steal the oldest tasks of other workers, preferring
+    // workers on their own NUMA node
+    WorkStealing,
+    // One queue per NUMA node ordered by task priority. Pipelines
+    // prioritize stages by their longest remaining path to the target
+    CriticalPath,
+};
+
+// NUMA layout workers are placed on: the CPU ids belonging to every node
+struct Topology {
+    std::vector<std::vector<int>> nodes;
+
+    // A single node with every CPU of the machine
+    static Topology single_node() {
+        Topology topology;
+        topology.nodes.emplace_back();
+        unsigned hc = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned cpu = 0; cpu < hc; cpu++) {
+            topology.nodes[0].push_back(static_cast<int>(cpu));
+        }
+        return topology;
+    }
+
+    // Evenly sized nodes with consecutive CPU ids, which lets tests simulate
+    // multi-node machines
+    static Topology simulated(size_t num_nodes, size_t cpus_per_node) {
+        Topology topology;
+        for (size_t node = 0; node < num_nodes; node++) {
+            topology.nodes.emplace_back();
+            for (size_t cpu = 0; cpu < cpus_per_node; cpu++) {
+                topology.nodes[node].push_back(
+                    static_cast<int>(node * cpus_per_node + cpu));
+            }
+        }
+        return topology;
+    }
+
+    // Reads the layout of the machine from sysfs, falling back to a single
+    // node where it is not available
+    static Topology detect() {
+        Topology topology;
+        for (size_t node = 0;; node++) {
+            std::ifstream f("/sys/devices/system/node/node" +
+                            std::to_string(node) + "/cpulist");
+            if (!f) {
+                break;
+            }
+            // Comma separated CPU ids and inclusive ranges, e.g. 0-3,8-11
+            std::vector<int> cpus;
+            std::string range;
+            while (std::getline(f, range, ',')) {
+                int first = 0;
+                int last = 0;
+                char dash = 0;
+                std::istringstream in(range);
+                if (!(in >> first)) {
+                    continue;
+                }
+                last = (in >> dash >> last) && dash == '-' ? last : first;
+                for (int cpu = first; cpu <= last; cpu++) {
+                    cpus.push_back(cpu);
+                }
+            }
+            // Memory-only nodes have no CPUs to run workers on
+            if (!cpus.empty()) {
+                topology.nodes.push_back(std::move(cpus));
+            }
+        }
+        if (topology.nodes.empty()) {
+            return single_node();
+        }
+        return topology;
+    }
+};
+
+// How workers are bound to the CPUs of their node
+enum class Pinning {
+    None,
+    // Each worker is bound to a single CPU
+    Core,
+    // Each worker may run on any CPU of its node
+    Node,
+};
+
+struct ExecutorOptions {
+    size_t num_threads = std::thread::hardware_concurrency();
+    SchedulerPolicy policy = SchedulerPolicy::WorkStealing;
+    // Detected from the machine when not given. Workers are spread round
+    // robin across nodes
+    std::optional<Topology> topology;
+    Pinning pinning = Pinning::None;
+    // Whether idle workers take tasks queued on other nodes. Without it,
+    // tasks submitted for a node with workers only ever run on that node
+    bool steal_across_nodes = true;
+};
+
+// A pool of worker threads which live for the lifetime of the Executor.
+// Pipelines submit ready stages to it, so one Executor may be shared across
+// many runs and many pipelines without paying for thread creation per run.
+class Executor {
+  private:
+    using Task = std::function<void()>;
+
+    struct PrioritizedTask {
+        double priority;
+        // Breaks ties in submission order
+        uint64_t seq;
+        Task task;
+
+        bool operator<(const PrioritizedTask &other) const {
+            if (priority != other.priority) {
+                return priority < other.priority;
+            }
+            return seq > other.seq;
+        }
+    };
+
+    struct TaskQueue {
+        std::mutex mut;
+        std::deque<Task> tasks;
+        std::priority_queue<PrioritizedTask> prioritized;
+        uint64_t next_seq = 0;
+        size_t node = 0;
+    };
+
+    struct Node {
+        std::vector<size_t> workers;
+        // Tasks queued on this node
+        std::atomic<size_t> pending = 0;
+        std::condition_variable wake;
+        size_t sleepers = 0;
+    };
+
+    SchedulerPolicy policy;
+    bool steal_across_nodes;
+    // One queue per worker under work stealing, one per node otherwise
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::vector<size_t> node_of_worker;
+    // Queues each worker pops from, own queue first and remote nodes last
+    std::vector<std::vector<size_t>> pop_order;
+    std::vector<std::thread> workers;
+    // Queues owned by some worker, over which tasks without a preferred
+    // queue are spread round robin
+    std::vector<size_t> staffed_queues;
+    std::atomic<size_t> next_queue = 0;
+
+    // Number of queued tasks, lets idle workers sleep without missing work
+    std::atomic<size_t> pending = 0;
+    std::mutex sleep_mut;
+    bool stopping = false;
+    // Submits from outside the pool which have not returned yet. The task
+    // may already have run, and its run returned, while the submitter still
+    // wakes a worker, so the destructor waits for them
+    std::atomic<size_t> outside_submits = 0;
+
+    static inline thread_local Executor *current_executor = nullptr;
+    static inline thread_local size_t current_worker = 0;
+
+    bool pop(size_t worker, Task &task) {
+        bool own = true;
+        for (size_t index : pop_order[worker]) {
+            TaskQueue &queue = *queues[index];
+            std::lock_guard<std::mutex> lg(queue.mut);
+            if (policy == SchedulerPolicy::CriticalPath) {
+                if (queue.prioritized.empty()) {
+                    continue;
+                }
+                // priority_queue only exposes a const top, the task is moved
+                // out right before popping it
+                task = std::move(
+                    const_cast<PrioritizedTask &>(queue.prioritized.top())
+                        .task);
+                queue.prioritized.pop();
+            } else if (queue.tasks.empty()) {
+                own = false;
+                continue;
+            } else if (own && policy == SchedulerPolicy::WorkStealing) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            nodes[queue.node]->pending.fetch_sub(1);
+            pending.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    // Must be called with sleep_mut held
+    bool has_work(size_t worker) const {
+        if (steal_across_nodes) {
+            return pending.load() > 0;
+        }
+        return nodes[node_of_worker[worker]]->pending.load() > 0;
+    }
+
+    void work(size_t worker) {
+        current_executor = this;
+        current_worker = worker;
+        Node &node = *nodes[node_of_worker[worker]];
+        while (true) {
+            Task task;
+            if (pop(worker, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> uniq(sleep_mut);
+            if (has_work(worker)) {
+                continue;
+            }
+            if (stopping) {
+                // Remaining tasks are drained before stopping
+                return;
+            }
+            node.sleepers++;
+            node.wake.wait(uniq,
+                           [&] { return stopping || has_work(worker); });
+            node.sleepers--;
+        }
+    }
+
+    size_t spread() {
+        return staffed_queues[next_queue.fetch_add(1) %
+                              staffed_queues.size()];
+    }
+
+    // Queues a task and wakes a worker for it
+    void enqueue(Task task, double priority, std::optional<size_t> node,
+                 bool inside) {
+        // Locality hints may name a node of another pool, which this pool
+        // has no workers on. Tasks queued there would never run without
+        // stealing across nodes
+        if (node.has_value() &&
+            (*node >= nodes.size() || nodes[*node]->workers.empty())) {
+            node.reset();
+        }
+        size_t target;
+        if (policy == SchedulerPolicy::WorkStealing) {
+            if (inside && (!node.has_value() ||
+                           node_of_worker[current_worker] == *node)) {
+                // Workers keep their own tasks local
+                target = current_worker;
+            } else if (node.has_value()) {
+                const std::vector<size_t> &local = nodes[*node]->workers;
+                target = local[next_queue.fetch_add(1) % local.size()];
+            } else {
+                target = spread();
+            }
+        } else if (node.has_value()) {
+            target = *node;
+        } else if (inside) {
+            target = node_of_worker[current_worker];
+        } else {
+            target = spread();
+        }
+
+        TaskQueue &queue = *queues[target];
+        Node &target_node = *nodes[queue.node];
+        // Counted before the push so that a worker popping the task never
+        // observes a negative count
+        pending.fetch_add(1);
+        target_node.pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lg(queue.mut);
+            if (policy == SchedulerPolicy::CriticalPath) {
+                queue.prioritized.push(
+                    {priority, queue.next_seq++, std::move(task)});
+            } else {
+                queue.tasks.push_back(std::move(task));
+            }
+        }
+        // Wake a single sleeping worker rather than the whole pool,
+        // preferably one on the node the task was queued on
+        std::lock_guard<std::mutex> lg(sleep_mut);
+        if (target_node.sleepers > 0) {
+            target_node.wake.notify_one();
+            return;
+        }
+        if (!steal_across_nodes) {
+            return;
+        }
+        for (auto &other : nodes) {
+            if (other->sleepers > 0) {
+                other->wake.notify_one();
+                return;
+            }
+        }
+    }
+
+    static void pin(std::thread &thread, const std::vector<int> &cpus) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        // Best effort, e.g. simulated topologies name CPUs which may not
+        // exist on this machine
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+    }
+
+  public:
+    explicit Executor(size_t num_threads = std::thread::hardware_concurrency(),
+                      SchedulerPolicy policy = SchedulerPolicy::WorkStealing)
+        : Executor(ExecutorOptions{num_threads, policy,
+                                   Topology::single_node()}) {}
+
+    explicit Executor(ExecutorOptions options)
+        : policy(options.policy),
+          steal_across_nodes(options.steal_across_nodes) {
+        size_t num_threads = std::max<size_t>(options.num_threads, 1);
+        Topology topology = options.topology.has_value()
+                                ? std::move(*options.topology)
+                                : Topology::detect();
+        if (topology.nodes.empty()) {
+            topology = Topology::single_node();
+        }
+        for (size_t n = 0; n < topology.nodes.size(); n++) {
+            nodes.push_back(std::make_unique<Node>());
+        }
+        for (size_t i = 0; i < num_threads; i++) {
+            size_t n = i % nodes.size();
+            node_of_worker.push_back(n);
+            nodes[n]->workers.push_back(i);
+        }
+
+        size_t num_queues =
+            policy == SchedulerPolicy::WorkStealing ? num_threads
+                                                    : nodes.size();
+        for (size_t i = 0; i < num_queues; i++) {
+            queues.push_back(std::make_unique<TaskQueue>());
+            queues[i]->node = policy == SchedulerPolicy::WorkStealing
+                                  ? node_of_worker[i]
+                                  : i;
+            if (!nodes[queues[i]->node]->workers.empty()) {
+                staffed_queues.push_back(i);
+            }
+        }
+        for (size_t i = 0; i < num_threads; i++) {
+            size_t own = policy == SchedulerPolicy::WorkStealing
+                             ? i
+                             : node_of_worker[i];
+            std::vector<size_t> order{own};
+            for (bool local : {true, false}) {
+                if (!local && !steal_across_nodes) {
+                    break;
+                }
+                for (size_t k = 1; k < num_queues; k++) {
+                    size_t index = (own + k) % num_queues;
+                    if ((queues[index]->node == node_of_worker[i]) == local) {
+                        order.push_back(index);
+                    }
+                }
+            }
+            pop_order.push_back(std::move(order));
+        }
+
+        for (size_t i = 0; i < num_threads; i++) {
+            workers.emplace_back([this, i] { work(i); });
+            if (options.pinning == Pinning::None) {
+                continue;
+            }
+            const std::vector<int> &cpus = topology.nodes[node_of_worker[i]];
+            if (cpus.empty()) {
+                continue;
+            }
+            if (options.pinning == Pinning::Core) {
+                // Workers of a node take turns over its CPUs
+                size_t slot = i / nodes.size();
+                pin(workers.back(), {cpus[slot % cpus.size()]});
+            } else {
+                pin(workers.back(), cpus);
+            }
+        }
+    }
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    ~Executor() {
+        while (outside_submits.load(std::memory_order_acquire) > 0) {
+            std::this_thread::yield();
+        }
+        {
+            std::lock_guard<std::mutex> lg(sleep_mut);
+            stopping = true;
+            for (auto &node : nodes) {
+                node->wake.notify_all();
+            }
+        }
+        for (auto &worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    size_t size() const { return workers.size(); }
+    size_t num_nodes() const { return nodes.size(); }
+    SchedulerPolicy scheduler_policy() const { return policy; }
+
+    // Executor owning the calling thread, or null outside of any pool
+    static Executor *current() { return current_executor; }
+    // NUMA node of the calling worker, if called from within a pool
+    static std::optional<size_t> current_node() {
+        if (current_executor == nullptr) {
+            return std::nullopt;
+        }
+        return current_executor->node_of_worker[current_worker];
+    }
+
+    // Higher priorities run first under SchedulerPolicy::CriticalPath, other
+    // policies ignore the priority. Tasks are queued on `node` if given and
+    // the pool has workers on it, otherwise on the node of the submitting
+    // worker or spread over the pool
+    void submit(Task task, double priority = 0,
+                std::optional<size_t> node = std::nullopt) {
+        bool inside = current_executor == this;
+        if (!inside) {
+            outside_submits.fetch_add(1, std::memory_order_relaxed);
+        }
+        enqueue(std::move(task), priority, node, inside);
+        // Nothing of the executor may be touched after this
+        if (!inside) {
+            outside_submits.fetch_sub(1, std::memory_order_release);
+        }
+    }
+};
+
+// Which pool of an ExecutorSet runs a stage
+struct ExecutionClass {
+    enum class Kind { Cpu, BlockingIo, Named };
+    Kind kind = Kind::Cpu;
+    std::string name;
+
+    static ExecutionClass cpu() { return {Kind::Cpu, {}}; }
+    static ExecutionClass blocking_io() { return {Kind::BlockingIo, {}}; }
+    static ExecutionClass named(std::string name) {
+        return {Kind::Named, std::move(name)};
+    }
+    bool operator==(const ExecutionClass &other) const = default;
+};
+
+// Executors a run dispatches stages to, by execution class. Named classes
+// without a pool of their own run on the CPU pool
+class ExecutorSet {
+  private:
+    Executor *cpu_pool;
+    Executor *io_pool;
+    std::unordered_map<std::string, Executor *> named_pools;
+
+  public:
+    // Every class runs on the same executor
+    explicit ExecutorSet(Executor &executor)
+        : cpu_pool(&executor), io_pool(&executor) {}
+    ExecutorSet(Executor &cpu, Executor &io) : cpu_pool(&cpu), io_pool(&io) {}
+
+    ExecutorSet &add_pool(std::string name, Executor &pool) {
+        named_pools[std::move(name)] = &pool;
+        return *this;
+    }
+
+    Executor &cpu() const { return *cpu_pool; }
+    // Also runs the blocking calls offloaded by asynchronous stages
+    Executor &io() const { return *io_pool; }
+    Executor &get(const ExecutionClass &execution_class) const {
+        switch (execution_class.kind) {
+        case ExecutionClass::Kind::Cpu:
+            return *cpu_pool;
+        case ExecutionClass::Kind::BlockingIo:
+            return *io_pool;
+        case ExecutionClass::Kind::Named:
+            break;
+        }
+        auto it = named_pools.find(execution_class.name);
+        return it != named_pools.end() ? *it->second : *cpu_pool;
+    }
+};
+
+// Coroutine type returned by the callables of asynchronous stages. A Task
+// starts suspended, and is either started by the pipeline or awaited by
+// another Task. Suspended Tasks resume on the Executor running their stage
+template <class T> class [[nodiscard]] Task {
+  public:
+    using value_type = T;
+
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr error;
+        // Awaiting Task, resumed once this one completes
+        std::coroutine_handle<> continuation;
+        // Set instead of a continuation for the outermost Task of a stage
+        std::function<void()> on_done;
+        Executor *executor = nullptr;
+        // Runs blocking calls offloaded by the Task, if set
+        Executor *blocking = nullptr;
+
+        Task get_return_object() {
+            return Task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<>
+                await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    promise_type &promise = h.promise();
+                    if (promise.continuation) {
+                        return promise.continuation;
+                    }
+                    // on_done may destroy the frame, so it is moved out of
+                    // the promise first
+                    std::function<void()> done = std::move(promise.on_done);
+                    done();
+                    return std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return FinalAwaiter{};
+        }
+        void return_value(T result) { value.emplace(std::move(result)); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    template <class Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> awaiting) noexcept {
+        handle.promise().executor = awaiting.promise().executor;
+        handle.promise().blocking = awaiting.promise().blocking;
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+        return std::move(*handle.promise().value);
+    }
+
+  private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle(handle) {}
+
+    template <class U>
+    friend void spawn(Task<U> task, Executor &executor, Executor *blocking,
+                      std::function<void(std::optional<U> &&,
+                                         std::exception_ptr)>
+                          done);
+};
+
+template <class T> struct is_task : std::false_type {};
+template <class T> struct is_task<Task<T>> : std::true_type {};
+
+// Starts a Task on the calling thread. `done` runs once it completes, with
+// either its value or the exception it threw. Blocking calls go to
+// `blocking` if given, otherwise to `executor`
+template <class T>
+void spawn(Task<T> task, Executor &executor, Executor *blocking,
+           std::function<void(std::optional<T> &&, std::exception_ptr)> done) {
+    auto handle = std::exchange(task.handle, {});
+    handle.promise().executor = &executor;
+    handle.promise().blocking = blocking;
+    handle.promise().on_done = [handle, done = std::move(done)]() {
+        std::optional<T> value = std::move(handle.promise().value);
+        std::exception_ptr error = handle.promise().error;
+        handle.destroy();
+        done(std::move(value), error);
+    };
+    handle.resume();
+}
+
+// Awaitable running a blocking callable on the blocking pool of the Task.
+// The awaiting Task is suspended meanwhile and resumes on its own Executor,
+// so that worker is free to run other stages
+template <class F> class BlockingAwaiter {
+  private:
+    using R = std::invoke_result_t<F &>;
+    F func;
+    std::optional<std::conditional_t<std::is_void_v<R>, std::monostate, R>>
+        result;
+    std::exception_ptr error;
+
+  public:
+    explicit BlockingAwaiter(F func) : func(std::move(func)) {}
+
+    bool await_ready() noexcept { return false; }
+    template <class Promise>
+    void await_suspend(std::coroutine_handle<Promise> awaiting) {
+        Executor *resume_on = awaiting.promise().executor;
+        Executor &offload_to = awaiting.promise().blocking
+                                   ? *awaiting.promise().blocking
+                                   : *resume_on;
+        offload_to.submit([this, awaiting, resume_on] {
+            try {
+                if constexpr (std::is_void_v<R>) {
+                    std::invoke(func);
+                    result.emplace();
+                } else {
+                    result.emplace(std::invoke(func));
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+            resume_on->submit([awaiting] { awaiting.resume(); });
+        });
+    }
+    R await_resume() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if constexpr (!std::is_void_v<R>) {
+            return std::move(*result);
+        }
+    }
+};
+
+template <class F> BlockingAwaiter<F> blocking(F func) {
+    return BlockingAwaiter<F>(std::move(func));
+}
+
+inline Task<ByteBuffer> read_file_async(std::string path) {
+    co_return co_await blocking(
+        [&path] { return ByteBuffer::read_file(path); });
+}
+
+inline Task<std::monostate> write_file_async(std::string path,
+                                             const ByteBuffer &data) {
+    co_await blocking([&path, &data] {
+        std::ofstream f(path, std::ios::binary);
+        if (!f || !f.write(reinterpret_cast<const char *>(data.data()),
+                           static_cast<std::streamsize>(data.size()))) {
+            throw Error::IoError;
+        }
+    });
+    co_return std::monostate{};
+}
+
+template <class Out, class F> class AsyncStage0 final : public IStage {
+  private:
+    StageId id;
+    F func;
+
+  public:
+    AsyncStage0(StageId id, F func)
+        : id(id), func(std::forward<F>(func)) {}
+
+    // Never run synchronously, plans start asynchronous stages with run_async
+    void run(Context & /*context*/) override { throw Error::RuntimeError; }
+    void run_fused(Context & /*context*/,
+                   std::span<IStage *const> /*chain*/) override {
+        throw Error::RuntimeError;
+    }
+
+    bool asynchronous() const override { return true; }
+    void run_async(Context &context, Executor &executor, Executor *blocking,
+                   Completion done) override {
+        spawn<Out>(std::invoke(func), executor, blocking,
+                   [this, &context, done = std::move(done)](
+                       std::optional<Out> &&result, std::exception_ptr error) {
+                       if (!error) {
+                           emit(id, std::move(*result), context, {});
+                       }
+                       done(error);
+                   });
+    }
+};
+
+template <class Out, class In, class F>
+class AsyncStage1 final : public IStage {
+  private:
+    StageId id;
+    F func;
+    size_t dep;
+
+  public:
+    AsyncStage1(StageId id, size_t input, F func)
+        : id(id), func(std::forward<F>(func)), dep(input) {}
+
+    // Never run synchronously, plans start asynchronous stages with run_async
+    void run(Context & /*context*/) override { throw Error::RuntimeError; }
+    void run_fused(Context & /*context*/,
+                   std::span<IStage *const> /*chain*/) override {
+        throw Error::RuntimeError;
+    }
+
+    bool asynchronous() const override { return true; }
+    void run_async(Context &context, Executor &executor, Executor *blocking,
+                   Completion done) override {
+        // The Task may hold a reference to its input across suspension
+        // points. The Context outlives every task of the run, so the stored
+        // input stays valid until the Task completes
+        spawn<Out>(std::invoke(func, context.get<In>(dep)), executor, blocking,
+                   [this, &context, done = std::move(done)](
+                       std::optional<Out> &&result, std::exception_ptr error) {
+                       if (!error) {
+                           emit(id, std::move(*result), context, {});
+                       }
+                       done(error);
+                   });
+    }
+};
+
+// Copies values of one output type out of and back into a Context, so that
+// memoized stages can keep their value across runs
+struct MemoOps {
+    std::shared_ptr<const void> (*capture)(const Context &, StageId id);
+    void (*restore)(Context &, StageId id, const void *value);
+    // Compares two kept values, null for types without operator==
+    bool (*equal)(const void *a, const void *b);
+};
+
+// std::equality_comparable holds for standard containers and pairs even when
+// their elements lack operator==, so look through them
+template <class T>
+inline constexpr bool memo_comparable = std::equality_comparable<T>;
+
+template <class A, class B>
+inline constexpr bool memo_comparable<std::pair<A, B>> =
+    memo_comparable<A> && memo_comparable<B>;
+
+template <class... Ts>
+inline constexpr bool memo_comparable<std::tuple<Ts...>> =
+    (memo_comparable<Ts> && ...);
+
+template <class T, class A>
+inline constexpr bool memo_comparable<std::vector<T, A>> = memo_comparable<T>;
+
+template <class T>
+inline constexpr bool memo_comparable<std::optional<T>> = memo_comparable<T>;
+
+template <class T>
+constexpr bool (*memo_equal())(const void *, const void *) {
+    if constexpr (memo_comparable<T>) {
+        return [](const void *a, const void *b) {
+            return *static_cast<const T *>(a) == *static_cast<const T *>(b);
+        };
+    } else {
+        return nullptr;
+    }
+}
+
+template <class T>
+inline constexpr MemoOps memo_ops_for = {
+    [](const Context &context, StageId id) -> std::shared_ptr<const void> {
+        return std::make_shared<const T>(context.copy<T>(id));
+    },
+    [](Context &context, StageId id, const void *value) {
+        context.publish(id, T(*static_cast<const T *>(value)));
+    },
+    memo_equal<T>()};
+
+// Writes values of one output type out of a Context and reads them back in,
+// for types with a Serializer. The value must not be spilled while written
+struct SerializeOps {
+    void (*write)(const Context &, StageId id, std::ostream &out);
+    void (*read)(Context &, StageId id, std::span<const std::byte> bytes);
+};
+
+template <class T>
+inline constexpr SerializeOps serialize_ops_for = {
+    [](const Context &context, StageId id, std::ostream &out) {
+        Serializer<T>::write(context.get<T>(id), out);
+    },
+    [](Context &context, StageId id, std::span<const std::byte> bytes) {
+        context.publish(id, Serializer<T>::read(bytes));
+    }};
+
+// The upstream closure of a target compiled into dense arrays, so that runs
+// schedule stages by index instead of hashing stage keys.
+struct ExecutionPlan {
+    // Graph version the plan was compiled against
+    size_t graph_version = 0;
+    // Inline storage of the output of every node, one slot per node
+    StorageLayout storage;
+    // Stages whose value has a single consumer in the plan and is neither
+    // the target nor retained, so the consumer may move it
+    std::vector<StageId> movable;
+    // Stages whose value a join in the plan holds handles to
+    std::vector<StageId> sharable;
+    // Stage whose output each node stores, which the Context maps to the
+    // slot of the node, and whether that output is destroyed once all of
+    // its consumers finished. The target and retained stages are kept
+    std::vector<StageId> output_stage;
+    std::vector<bool> releasable;
+    // How to memoize the output of each node which is a single pure stage,
+    // null for every other node
+    std::vector<const MemoOps *> memo_ops;
+    // How to serialize the output of each node, null if its type has no
+    // Serializer
+    std::vector<const SerializeOps *> serialize_ops;
+    // Names pure nodes are stored under in a disk cache: the stage id and
+    // the version it was marked pure with. Empty for nodes which are not
+    // cached, such as sources whose value is set from outside the pipeline
+    std::vector<std::string> cache_names;
+    // Nodes whose output is hashed when a disk cache is set, since a pure
+    // node reads it
+    std::vector<bool> hash_output;
+    // Stages of the plan added by read_bytes_from_file, checked for changes
+    // of their file before every run
+    std::vector<std::pair<StageId, std::shared_ptr<FileSource>>> file_sources;
+    // Nodes are numbered in topological order. Each node runs its head
+    // stage followed by the stages fused behind it:
+    // fused[fused_offsets[i]..fused_offsets[i + 1])
+    std::vector<IStage *> stages;
+    std::vector<size_t> fused_offsets;
+    std::vector<IStage *> fused;
+    // Names the stages of each node, for diagnostics
+    std::vector<Key> keys;
+    // Measured cost of each node, owned by the pipeline. A fused node is
+    // timed as a whole and attributed to its head stage
+    std::vector<std::atomic<double> *> costs;
+    // CSR adjacency: downstream of node i are
+    // downstream[downstream_offsets[i]..downstream_offsets[i + 1])
+    std::vector<size_t> downstream_offsets;
+    std::vector<size_t> downstream;
+    // Inverse adjacency, laid out the same way
+    std::vector<size_t> upstream_offsets;
+    std::vector<size_t> upstream;
+    std::vector<int> in_degree;
+    std::vector<size_t> sources;
+    size_t target = 0;
+    // Distinct execution classes of the plan, and the class of each node
+    std::vector<ExecutionClass> classes;
+    std::vector<size_t> class_of;
+    // Whether a node runs on the I/O pool, or is asynchronous and offloads
+    // its blocking calls there
+    bool uses_io_pool = false;
+};
+
+// Memory held in the Context by stage outputs during a run, as counted by
+// resident_bytes()
+struct RunStats {
+    // Most bytes held at any point of the run
+    size_t peak_resident_bytes = 0;
+    // Bytes still held once the run finished, by the target and retained
+    // stages
+    size_t resident_bytes = 0;
+    // Bytes allocated from the arena of the run
+    size_t arena_bytes = 0;
+    // Values written to and read back from disk to stay within the memory
+    // budget, see SpillOptions
+    size_t spilled_bytes = 0;
+    size_t reloaded_bytes = 0;
+    std::chrono::nanoseconds spill_time{0};
+    std::chrono::nanoseconds reload_time{0};
+};
+
+class Pipeline {
+  private:
+    // Stages indexed by StageId. Ids are handed out in creation order and
+    // stages can only depend on earlier stages, so ids are a topological
+    // order of the graph
+    std::vector<std::unique_ptr<IStage>> stages;
+    // Inputs of every stage, fixed when it is added: those of stage `id` are
+    // upstream_ids[upstream_offsets[id], upstream_offsets[id + 1])
+    std::vector<StageId> upstream_ids;
+    std::vector<size_t> upstream_offsets = {0};
+    // Consumers of every stage, as lists threaded through a single edge
+    // array in the order they were added
+    struct Edge {
+        StageId to;
+        size_t next;
+    };
+    static constexpr size_t no_edge = -1;
+    std::vector<Edge> downstream_edges;
+    std::vector<size_t> first_downstream;
+    std::vector<size_t> last_downstream;
+
+    // Bumped by every graph mutation, invalidating cached plans. Mutations
+    // are not synchronized with runs, and must happen while none is in
+    // flight
+    size_t graph_version = 0;
+    // Guards the plan cache and the results of the last run. Everything
+    // else a run reads is immutable once the graph is built, so any number
+    // of runs may execute concurrently
+    mutable std::mutex run_mut;
+    // Cached plans indexed by target StageId
+    mutable std::vector<std::shared_ptr<const ExecutionPlan>> plans;
+    // Context of the last successful run, read by result()
+    mutable std::shared_ptr<const Context> last_run;
+    // Arenas of finished runs, reused by the next ones
+    std::shared_ptr<ArenaPool> arenas = std::make_shared<ArenaPool>();
+
+    // Names of the stages, only used to reject duplicates and for
+    // diagnostics. Shared with the Ports of each stage, and viewed by id_of
+    std::vector<std::shared_ptr<const Key>> stage_keys;
+    std::unordered_map<std::string_view, StageId> id_of;
+    // Moving average of measured execution time per stage in nanoseconds,
+    // indexed by stage index. Negative while a stage has never run
+    mutable std::deque<std::atomic<double>> stage_costs;
+    // Costs loaded from a file, applied to stages as they are added
+    std::unordered_map<Key, double> loaded_costs;
+    // Stages whose value stays observable through result(), indexed by
+    // stage index. Retained stages are never fused away
+    std::vector<bool> retained;
+    // Execution class of each stage, indexed by stage index
+    std::vector<ExecutionClass> placement;
+    // Size and alignment of the output type of each stage, indexed by stage
+    // index
+    std::vector<std::pair<size_t, size_t>> output_layout;
+    // Spilling is off unless set
+    std::optional<SpillOptions> spill_options;
+
+    // Output of a pure stage kept across runs
+    struct Memo {
+        std::shared_ptr<const void> value;
+        // Unique among all values ever memoized by the pipeline
+        uint64_t version = 0;
+        // Input stages and the versions of their values it was computed from
+        std::vector<std::pair<StageId, uint64_t>> inputs;
+        // Content hash of the value, if it was computed
+        std::optional<ContentHash> hash;
+        // Generation of its stage when the run computing it started
+        uint64_t generation = 0;
+    };
+    // Memos indexed by StageId, replaced by the runs which recompute them
+    struct MemoStore {
+        std::mutex mut;
+        std::vector<Memo> memos;
+        // Bumped whenever the value of a source changes from outside the
+        // pipeline or a stage is invalidated. Memos of an older generation
+        // are never reused, only compared against the value which replaces
+        // them, and runs which started before the bump do not store theirs
+        std::vector<uint64_t> generations;
+        // Stages invalidated since they were last computed. Their disk cache
+        // entries are not read, only overwritten once they are recomputed
+        std::vector<bool> invalidated;
+        uint64_t next_version = 1;
+    };
+    mutable MemoStore memo_store;
+    // Stages whose output only depends on their inputs, indexed by StageId
+    std::vector<bool> pure;
+    // How to memoize each stage, null for types which cannot be copied
+    std::vector<const MemoOps *> memo_ops;
+    // Version each pure stage was marked with, part of its disk cache key
+    std::vector<std::string> pure_versions;
+    // How to serialize the output of each stage, null for types without a
+    // Serializer
+    std::vector<const SerializeOps *> serialize_ops;
+    // Outputs of pure stages persisted across processes, unless null
+    std::shared_ptr<DiskCache> disk_cache;
+    // SourceCell of each stage added by add_source, null for other stages
+    std::vector<std::shared_ptr<void>> source_cells;
+    // File read by each stage added by read_bytes_from_file, null for other
+    // stages
+    std::vector<std::shared_ptr<FileSource>> file_sources;
+    // Targets rerun by watch, and what to do with each of their results
+    struct WatchedTarget {
+        StageId target;
+        std::function<void(const Pipeline &, const ExecutorSet &)> run;
+    };
+    std::vector<WatchedTarget> watched;
+    static constexpr double cost_smoothing = 0.2;
+
+    std::span<const StageId> upstream_of(StageId stage) const {
+        return {upstream_ids.data() + upstream_offsets[stage],
+                upstream_ids.data() + upstream_offsets[stage + 1]};
+    }
+
+    template <class F> void for_each_downstream(StageId stage, F &&f) const {
+        for (size_t edge = first_downstream[stage]; edge != no_edge;
+             edge = downstream_edges[edge].next) {
+            f(downstream_edges[edge].to);
+        }
+    }
+
+    // Adds a stage whose upstream stages have already been validated,
+    // unless its name is taken
+    template <class Out>
+    Result<Port<Out>> register_stage(Key id, std::unique_ptr<IStage> stage_ptr,
+                                     std::initializer_list<StageId> upstream) {
+        StageId stage = stages.size();
+        // The name is only hashed here, and moved rather than copied
+        auto key = std::make_shared<const Key>(std::move(id));
+        if (!id_of.try_emplace(*key, stage).second) {
+            return std::unexpected(Error::StageAlreadyExists);
+        }
+        stages.push_back(std::move(stage_ptr));
+        upstream_ids.insert(upstream_ids.end(), upstream);
+        upstream_offsets.push_back(upstream_ids.size());
+        first_downstream.push_back(no_edge);
+        last_downstream.push_back(no_edge);
+        for (StageId dep : upstream) {
+            size_t edge = downstream_edges.size();
+            downstream_edges.push_back({stage, no_edge});
+            if (last_downstream[dep] == no_edge) {
+                first_downstream[dep] = edge;
+            } else {
+                downstream_edges[last_downstream[dep]].next = edge;
+            }
+            last_downstream[dep] = edge;
+        }
+        {
+            std::lock_guard<std::mutex> lg(run_mut);
+            plans.emplace_back();
+        }
+        double cost = -1.0;
+        if (!loaded_costs.empty()) {
+            auto loaded = loaded_costs.find(*key);
+            if (loaded != loaded_costs.end()) {
+                cost = loaded->second;
+            }
+        }
+        stage_costs.emplace_back(cost);
+        retained.push_back(false);
+        placement.push_back(ExecutionClass::cpu());
+        output_layout.emplace_back(sizeof(Out), alignof(Out));
+        pure.push_back(false);
+        pure_versions.emplace_back();
+        source_cells.emplace_back();
+        file_sources.emplace_back();
+        if constexpr (Serializable<Out>) {
+            serialize_ops.push_back(&serialize_ops_for<Out>);
+        } else {
+            serialize_ops.push_back(nullptr);
+        }
+        if constexpr (std::copy_constructible<Out>) {
+            memo_ops.push_back(&memo_ops_for<Out>);
+        } else {
+            memo_ops.push_back(nullptr);
+        }
+        {
+            std::lock_guard<std::mutex> lg(memo_store.mut);
+            memo_store.memos.emplace_back();
+            memo_store.generations.push_back(0);
+            memo_store.invalidated.push_back(false);
+        }
+        stage_keys.push_back(key);
+        graph_version++;
+        return Port<Out>(this, stage, std::move(key));
+    }
+
+    // File stages default to the blocking I/O pool
+    template <class T> Result<Port<T>> place_on_io(Result<Port<T>> port) {
+        if (port.has_value()) {
+            placement.at(port.value().id) = ExecutionClass::blocking_io();
+        }
+        return port;
+    }
+
+    Result<std::shared_ptr<const ExecutionPlan>>
+    compile_plan(StageId target) const {
+        if (target >= stages.size()) {
+            return std::unexpected(Error::UnknownStage);
+        }
+        // The closure is collected by walking upstream from the target, so
+        // that a plan costs time and memory in proportion to its closure
+        // rather than to the whole graph
+        std::vector<StageId> members{target};
+        {
+            StageIndex visited;
+            visited.insert(target);
+            for (size_t i = 0; i < members.size(); i++) {
+                for (StageId dep : upstream_of(members[i])) {
+                    size_t known = visited.size();
+                    if (visited.insert(dep) == known) {
+                        members.push_back(dep);
+                    }
+                }
+            }
+        }
+        // Ids are a topological order
+        std::sort(members.begin(), members.end());
+        const StageIndex closure(members);
+
+        auto plan = std::make_shared<ExecutionPlan>();
+        plan->graph_version = graph_version;
+
+        // Stages outside the closure never run for this target
+        auto consumers = [&](StageId stage) {
+            std::vector<StageId> in_closure;
+            for_each_downstream(stage, [&](StageId downstream) {
+                if (closure.find(downstream) != StageIndex::npos) {
+                    in_closure.push_back(downstream);
+                }
+            });
+            return in_closure;
+        };
+        // A single input stage is fused behind its upstream when it is the
+        // only consumer of a value nobody asked to observe or memoize
+        auto fuses_into_upstream = [&](StageId stage) {
+            std::span<const StageId> deps = upstream_of(stage);
+            // Pure stages keep nodes of their own, so their value is stored
+            if (deps.size() != 1 || pure[stage] || !stages[stage]->fusible()) {
+                return false;
+            }
+            StageId dep = deps.front();
+            return dep != target && !retained[dep] && !pure[dep] &&
+                   !stages[dep]->asynchronous() &&
+                   placement[dep] == placement[stage] &&
+                   consumers(dep).size() == 1;
+        };
+
+        // Fusion pass over the closure in id order, which is topological:
+        // every stage which is not fused starts a node, and absorbs the
+        // chain of fusible stages following it
+        // Node of each member, indexed by its position in the closure
+        std::vector<size_t> node_of(members.size());
+        std::vector<StageId> tails;
+        for (StageId stage : members) {
+            if (fuses_into_upstream(stage)) {
+                continue;
+            }
+            size_t node = plan->stages.size();
+            plan->stages.push_back(stages[stage].get());
+            plan->fused_offsets.push_back(plan->fused.size());
+            plan->costs.push_back(&stage_costs[stage]);
+            Key label = *stage_keys[stage];
+            node_of[closure.find(stage)] = node;
+            StageId tail = stage;
+            while (true) {
+                std::vector<StageId> next = consumers(tail);
+                if (next.size() != 1 || !fuses_into_upstream(next.front())) {
+                    break;
+                }
+                tail = next.front();
+                plan->fused.push_back(stages[tail].get());
+                node_of[closure.find(tail)] = node;
+                label += " -> " + *stage_keys[tail];
+            }
+            plan->keys.push_back(std::move(label));
+            bool memoized = tail == stage && pure[stage];
+            plan->memo_ops.push_back(memoized ? memo_ops[stage] : nullptr);
+            plan->serialize_ops.push_back(serialize_ops[tail]);
+            bool cached = memoized && source_cells[stage] == nullptr &&
+                          file_sources[stage] == nullptr;
+            if (file_sources[stage] != nullptr) {
+                plan->file_sources.emplace_back(stage, file_sources[stage]);
+            }
+            plan->cache_names.push_back(
+                cached ? *stage_keys[stage] + '\0' + pure_versions[stage]
+                       : std::string());
+            const ExecutionClass &execution_class = placement[stage];
+            auto known = std::find(plan->classes.begin(), plan->classes.end(),
+                                   execution_class);
+            plan->class_of.push_back(known - plan->classes.begin());
+            if (known == plan->classes.end()) {
+                plan->classes.push_back(execution_class);
+            }
+            if (execution_class.kind == ExecutionClass::Kind::BlockingIo ||
+                stages[stage]->asynchronous()) {
+                plan->uses_io_pool = true;
+            }
+            int in_degree = static_cast<int>(upstream_of(stage).size());
+            plan->in_degree.push_back(in_degree);
+            if (in_degree == 0) {
+                plan->sources.push_back(node);
+            }
+            tails.push_back(tail);
+        }
+        plan->fused_offsets.push_back(plan->fused.size());
+
+        // One slot per node, holding the output of its tail
+        size_t n = plan->stages.size();
+        plan->storage.index = std::make_shared<const StageIndex>(tails);
+        plan->storage.offsets.assign(n, StorageLayout::none);
+        plan->storage.capacities.assign(n, 0);
+        for (size_t node = 0; node < n; node++) {
+            StageId tail = tails[node];
+            plan->downstream_offsets.push_back(plan->downstream.size());
+            std::vector<StageId> next = consumers(tail);
+            for (StageId downstream : next) {
+                plan->downstream.push_back(node_of[closure.find(downstream)]);
+            }
+            plan->output_stage.push_back(tail);
+            // Over-aligned outputs are allocated when published instead
+            auto [size, align] = output_layout[tail];
+            if (align <= alignof(std::max_align_t)) {
+                size_t offset =
+                    (plan->storage.bytes + align - 1) / align * align;
+                plan->storage.offsets[node] = offset;
+                plan->storage.capacities[node] = size;
+                plan->storage.bytes = offset + size;
+            }
+            plan->releasable.push_back(tail != target && !retained[tail]);
+            if (next.size() == 1 && tail != target && !retained[tail]) {
+                plan->movable.push_back(tail);
+            }
+            if (std::any_of(next.begin(), next.end(), [&](StageId consumer) {
+                    return stages[consumer]->shares_inputs();
+                })) {
+                plan->sharable.push_back(tail);
+            }
+        }
+        plan->downstream_offsets.push_back(plan->downstream.size());
+
+        plan->upstream_offsets.assign(n + 1, 0);
+        for (size_t downstream : plan->downstream) {
+            plan->upstream_offsets[downstream + 1]++;
+        }
+        for (size_t node = 0; node < n; node++) {
+            plan->upstream_offsets[node + 1] += plan->upstream_offsets[node];
+        }
+        plan->upstream.resize(plan->downstream.size());
+        std::vector<size_t> filled(plan->upstream_offsets.begin(),
+                                   plan->upstream_offsets.end() - 1);
+        for (size_t node = 0; node < n; node++) {
+            for (size_t i = plan->downstream_offsets[node];
+                 i < plan->downstream_offsets[node + 1]; i++) {
+                plan->upstream[filled[plan->downstream[i]]++] = node;
+            }
+        }
+        plan->hash_output.assign(n, false);
+        for (size_t node = 0; node < n; node++) {
+            if (plan->memo_ops[node] == nullptr) {
+                continue;
+            }
+            for (size_t i = plan->upstream_offsets[node];
+                 i < plan->upstream_offsets[node + 1]; i++) {
+                plan->hash_output[plan->upstream[i]] = true;
+            }
+        }
+        plan->target = node_of[closure.find(target)];
+        return plan;
+    }
+
+    Result<std::shared_ptr<const ExecutionPlan>>
+    get_plan(StageId target) const {
+        std::lock_guard<std::mutex> lg(run_mut);
+        std::shared_ptr<const ExecutionPlan> &cached = plans.at(target);
+        if (!cached || cached->graph_version != graph_version) {
+            auto compiled = compile_plan(target);
+            if (!compiled.has_value()) {
+                return compiled;
+            }
+            cached = std::move(compiled.value());
+        }
+        return cached;
+    }
+
+    // Bookkeeping of a single run, shared by all tasks the run submits
+    struct RunState {
+        const ExecutionPlan &plan;
+        Context &context;
+        const ExecutorSet &executors;
+        MemoStore &memo;
+        // Memoized values of nodes whose inputs did not change since, which
+        // are reused instead of run. Only restored into the Context if a
+        // node which runs, or the caller, reads them
+        std::vector<std::shared_ptr<const void>> reused;
+        std::vector<bool> restore;
+        // Version of the value of each memoized node in this run
+        std::vector<uint64_t> versions;
+        // Null unless pure stages are persisted across processes
+        DiskCache *disk = nullptr;
+        // Content hash of each node output read by a pure node
+        std::vector<std::optional<ContentHash>> hashes;
+        // Generation of the stage of each node when the run started
+        std::vector<uint64_t> generations;
+        // Executor of each execution class of the plan
+        std::vector<Executor *> pools;
+        std::unique_ptr<std::atomic<int>[]> indeg;
+        // NUMA node each finished node ran on, -1 if unknown
+        std::unique_ptr<std::atomic<int>[]> produced_on;
+        // Consumers of each node's output which have not finished yet
+        std::unique_ptr<std::atomic<int>[]> readers;
+        // Only filled under SchedulerPolicy::CriticalPath
+        std::vector<double> priority;
+        std::atomic<size_t> in_flight = 0;
+        std::atomic<bool> failed = false;
+        Error err = Error::RuntimeError;
+
+        std::mutex mut;
+        std::condition_variable finished;
+        bool done = false;
+
+        RunState(const ExecutionPlan &plan, Context &context,
+                 const ExecutorSet &executors, MemoStore &memo)
+            : plan(plan), context(context), executors(executors), memo(memo),
+              reused(plan.stages.size()), restore(plan.stages.size()),
+              versions(plan.stages.size()), hashes(plan.stages.size()),
+              generations(plan.stages.size()),
+              indeg(std::make_unique<std::atomic<int>[]>(plan.stages.size())),
+              produced_on(
+                  std::make_unique<std::atomic<int>[]>(plan.stages.size())),
+              readers(
+                  std::make_unique<std::atomic<int>[]>(plan.stages.size())) {
+            for (const ExecutionClass &execution_class : plan.classes) {
+                pools.push_back(&executors.get(execution_class));
+            }
+            for (size_t node = 0; node < plan.stages.size(); node++) {
+                indeg[node].store(plan.in_degree[node],
+                                  std::memory_order_relaxed);
+                produced_on[node].store(-1, std::memory_order_relaxed);
+                readers[node].store(static_cast<int>(
+                                        plan.downstream_offsets[node + 1] -
+                                        plan.downstream_offsets[node]),
+                                    std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // Upward rank of every node: its own cost plus the most expensive path
+    // from it to the target. Stages which never ran are assumed to cost the
+    // average of those that did
+    static std::vector<double> upward_ranks(const ExecutionPlan &plan) {
+        size_t n = plan.stages.size();
+        std::vector<double> rank(n);
+        double known_total = 0;
+        size_t known = 0;
+        for (size_t node = 0; node < n; node++) {
+            rank[node] = plan.costs[node]->load(std::memory_order_relaxed);
+            if (rank[node] >= 0) {
+                known_total += rank[node];
+                known++;
+            }
+        }
+        double fallback = known > 0 ? known_total / known : 1.0;
+        for (size_t node = n; node-- > 0;) {
+            double longest = 0;
+            for (size_t i = plan.downstream_offsets[node];
+                 i < plan.downstream_offsets[node + 1]; i++) {
+                longest = std::max(longest, rank[plan.downstream[i]]);
+            }
+            if (rank[node] < 0) {
+                rank[node] = fallback;
+            }
+            rank[node] += longest;
+        }
+        return rank;
+    }
+
+    static void record_cost(std::atomic<double> &cost, double sample) {
+        double prev = cost.load(std::memory_order_relaxed);
+        double next;
+        do {
+            next = prev < 0 ? sample : prev + cost_smoothing * (sample - prev);
+        } while (!cost.compare_exchange_weak(prev, next,
+                                             std::memory_order_relaxed));
+    }
+
+    static Executor &executor_of(RunState &state, size_t node) {
+        return *state.pools[state.plan.class_of[node]];
+    }
+
+    // NUMA node most of the inputs of a node were produced on
+    static std::optional<size_t> input_node(RunState &state, size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        std::optional<size_t> best;
+        size_t best_count = 0;
+        for (size_t i = plan.upstream_offsets[node];
+             i < plan.upstream_offsets[node + 1]; i++) {
+            int candidate = state.produced_on[plan.upstream[i]].load(
+                std::memory_order_relaxed);
+            if (candidate < 0) {
+                continue;
+            }
+            size_t count = 0;
+            for (size_t j = plan.upstream_offsets[node];
+                 j < plan.upstream_offsets[node + 1]; j++) {
+                count += state.produced_on[plan.upstream[j]].load(
+                             std::memory_order_relaxed) == candidate;
+            }
+            if (count > best_count) {
+                best = static_cast<size_t>(candidate);
+                best_count = count;
+            }
+        }
+        return best;
+    }
+
+    static void schedule(RunState &state, size_t node) {
+        Executor &executor = executor_of(state, node);
+        double priority = state.priority.empty() ? 0 : state.priority[node];
+        std::optional<size_t> preferred;
+        if (executor.num_nodes() > 1) {
+            preferred = input_node(state, node);
+        }
+        executor.submit([&state, node] { run_stage(state, node); }, priority,
+                        preferred);
+    }
+
+    static void record_node(RunState &state, size_t node) {
+        std::optional<size_t> current = Executor::current_node();
+        if (current.has_value()) {
+            state.produced_on[node].store(static_cast<int>(*current),
+                                          std::memory_order_relaxed);
+        }
+    }
+
+    static void fail(RunState &state, size_t node, std::exception_ptr error) {
+        Error e = Error::RuntimeError;
+        try {
+            std::rethrow_exception(error);
+        } catch (Error thrown) {
+            e = thrown;
+        } catch (const std::exception &thrown) {
+            std::cerr << "Stage " << state.plan.keys[node]
+                      << " threw: " << thrown.what() << "\n";
+        } catch (...) {
+            std::cerr << "Stage " << state.plan.keys[node]
+                      << " threw an unknown exception\n";
+        }
+        if (!state.failed.exchange(true)) {
+            state.err = e;
+        }
+    }
+
+    // Keeps the inputs of a node in memory while it runs, reloading those
+    // which were spilled
+    static void pin_inputs(RunState &state, size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        if (!state.context.spilling()) {
+            return;
+        }
+        for (size_t i = plan.upstream_offsets[node];
+             i < plan.upstream_offsets[node + 1]; i++) {
+            state.context.pin(plan.output_stage[plan.upstream[i]]);
+        }
+    }
+
+    // Destroys inputs of a finished node which it was the last reader of
+    static void release_inputs(RunState &state, size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        for (size_t i = plan.upstream_offsets[node];
+             i < plan.upstream_offsets[node + 1]; i++) {
+            size_t upstream = plan.upstream[i];
+            if (state.context.spilling()) {
+                state.context.unpin(plan.output_stage[upstream]);
+            }
+            if (state.readers[upstream].fetch_sub(
+                    1, std::memory_order_acq_rel) == 1 &&
+                plan.releasable[upstream]) {
+                state.context.release(plan.output_stage[upstream]);
+            }
+        }
+    }
+
+    enum class Outcome { Finished, Failed, Suspended };
+
+    // Picks the memoized nodes whose inputs are all reused, with the versions
+    // their memo was computed from. Nodes are numbered in topological order,
+    // so the inputs of a node are decided before it
+    static void find_reusable(RunState &state) {
+        const ExecutionPlan &plan = state.plan;
+        size_t n = plan.stages.size();
+        {
+            std::lock_guard<std::mutex> lg(state.memo.mut);
+            for (size_t node = 0; node < n; node++) {
+                StageId stage = plan.output_stage[node];
+                const Memo &memo = state.memo.memos[stage];
+                state.generations[node] = state.memo.generations[stage];
+                size_t first = plan.upstream_offsets[node];
+                size_t last = plan.upstream_offsets[node + 1];
+                if (plan.memo_ops[node] == nullptr || !memo.value ||
+                    memo.generation != state.generations[node] ||
+                    memo.inputs.size() != last - first) {
+                    continue;
+                }
+                bool unchanged = true;
+                for (size_t i = first; unchanged && i < last; i++) {
+                    size_t upstream = plan.upstream[i];
+                    unchanged = state.reused[upstream] != nullptr &&
+                                memo.inputs[i - first] ==
+                                    std::make_pair(plan.output_stage[upstream],
+                                                   state.versions[upstream]);
+                }
+                if (unchanged) {
+                    state.reused[node] = memo.value;
+                    state.versions[node] = memo.version;
+                    state.hashes[node] = memo.hash;
+                }
+            }
+        }
+        for (size_t node = 0; node < n; node++) {
+            if (state.reused[node] == nullptr) {
+                continue;
+            }
+            // The target and retained stages are read by the caller
+            state.restore[node] = !plan.releasable[node];
+            for (size_t i = plan.downstream_offsets[node];
+                 i < plan.downstream_offsets[node + 1]; i++) {
+                if (state.reused[plan.downstream[i]] == nullptr) {
+                    state.restore[node] = true;
+                }
+            }
+        }
+    }
+
+    // Stores the value a memoized node computed for later runs
+    static void remember(RunState &state, size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        const MemoOps *ops = plan.memo_ops[node];
+        if (ops == nullptr) {
+            return;
+        }
+        StageId stage = plan.output_stage[node];
+        Memo memo;
+        memo.value = ops->capture(state.context, stage);
+        memo.generation = state.generations[node];
+        memo.hash = state.hashes[node];
+        for (size_t i = plan.upstream_offsets[node];
+             i < plan.upstream_offsets[node + 1]; i++) {
+            size_t upstream = plan.upstream[i];
+            memo.inputs.emplace_back(plan.output_stage[upstream],
+                                     state.versions[upstream]);
+        }
+        std::lock_guard<std::mutex> lg(state.memo.mut);
+        const Memo &previous = state.memo.memos[stage];
+        bool unchanged =
+            previous.value &&
+            ((ops->equal != nullptr &&
+              ops->equal(previous.value.get(), memo.value.get())) ||
+             (memo.hash.has_value() && memo.hash == previous.hash));
+        // Early cutoff: an unchanged value keeps its version, so consumers
+        // computed from the previous value are still reused
+        memo.version =
+            unchanged ? previous.version : state.memo.next_version++;
+        state.versions[node] = memo.version;
+        // The stage was invalidated or its sources changed since this run
+        // started, so its value must not be brought back
+        if (memo.generation != state.memo.generations[stage]) {
+            return;
+        }
+        state.memo.memos[stage] = std::move(memo);
+    }
+
+    // Key a pure node's output is stored under in the disk cache, if every
+    // input has a known content hash
+    static std::optional<ContentHash> cache_key(RunState &state,
+                                                size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        if (state.disk == nullptr || plan.cache_names[node].empty() ||
+            plan.serialize_ops[node] == nullptr) {
+            return std::nullopt;
+        }
+        ContentHasher hasher;
+        hasher.update(plan.cache_names[node]);
+        for (size_t i = plan.upstream_offsets[node];
+             i < plan.upstream_offsets[node + 1]; i++) {
+            const std::optional<ContentHash> &input =
+                state.hashes[plan.upstream[i]];
+            if (!input.has_value()) {
+                return std::nullopt;
+            }
+            hasher.update(*input);
+        }
+        return hasher.digest();
+    }
+
+    // Hashes the output of a node for the pure nodes reading it, and stores
+    // it in the disk cache under `key`
+    static void persist(RunState &state, size_t node,
+                        const std::optional<ContentHash> &key) {
+        const ExecutionPlan &plan = state.plan;
+        const SerializeOps *ops = plan.serialize_ops[node];
+        bool hash = state.disk != nullptr && plan.hash_output[node];
+        if (ops == nullptr || (!hash && !key.has_value())) {
+            return;
+        }
+        StageId id = plan.output_stage[node];
+        Context &context = state.context;
+        // Reloads the output if it was spilled as soon as it was published
+        if (context.spilling()) {
+            context.pin(id);
+        }
+        if (hash) {
+            ContentHasher hasher;
+            std::ostream out(&hasher);
+            ops->write(context, id, out);
+            state.hashes[node] = hasher.digest();
+        }
+        if (key.has_value()) {
+            state.disk->store(*key, [&](std::ostream &out) {
+                ops->write(context, id, out);
+            });
+            // Unless the stage was invalidated again since this run started
+            std::lock_guard<std::mutex> lg(state.memo.mut);
+            if (state.generations[node] == state.memo.generations[id]) {
+                state.memo.invalidated[id] = false;
+            }
+        }
+        if (context.spilling()) {
+            context.unpin(id);
+        }
+    }
+
+    // Whether the disk cache entry of a node may stand in for running it
+    static bool cache_readable(RunState &state, size_t node) {
+        std::lock_guard<std::mutex> lg(state.memo.mut);
+        return !state.memo.invalidated[state.plan.output_stage[node]];
+    }
+
+    // Early cutoff: a memoized node whose inputs were recomputed by this run
+    // can still reuse its value if they all came out unchanged. Only pure
+    // inputs have versions to compare
+    static bool inputs_cut_off(RunState &state, size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        size_t first = plan.upstream_offsets[node];
+        size_t last = plan.upstream_offsets[node + 1];
+        if (plan.memo_ops[node] == nullptr || first == last) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lg(state.memo.mut);
+        const Memo &memo = state.memo.memos[plan.output_stage[node]];
+        if (!memo.value || memo.generation != state.generations[node] ||
+            memo.inputs.size() != last - first) {
+            return false;
+        }
+        for (size_t i = first; i < last; i++) {
+            size_t upstream = plan.upstream[i];
+            if (plan.memo_ops[upstream] == nullptr ||
+                memo.inputs[i - first] !=
+                    std::make_pair(plan.output_stage[upstream],
+                                   state.versions[upstream])) {
+                return false;
+            }
+        }
+        state.reused[node] = memo.value;
+        state.versions[node] = memo.version;
+        state.hashes[node] = memo.hash;
+        return true;
+    }
+
+    // Stands in for a node whose memoized value is still valid
+    static Outcome reuse(RunState &state, size_t node, bool restore) {
+        const ExecutionPlan &plan = state.plan;
+        try {
+            pin_inputs(state, node);
+            if (restore) {
+                plan.memo_ops[node]->restore(state.context,
+                                             plan.output_stage[node],
+                                             state.reused[node].get());
+            }
+            release_inputs(state, node);
+        } catch (...) {
+            fail(state, node, std::current_exception());
+            return Outcome::Failed;
+        }
+        return Outcome::Finished;
+    }
+
+    static Outcome execute(RunState &state, size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        if (state.reused[node] != nullptr) {
+            return reuse(state, node, state.restore[node]);
+        }
+        // Consumers were not reused up front, so they read the value
+        if (inputs_cut_off(state, node)) {
+            return reuse(state, node, true);
+        }
+        auto start = std::chrono::steady_clock::now();
+        try {
+            pin_inputs(state, node);
+            if (plan.stages[node]->asynchronous()) {
+                // Completes later on whichever worker resumes the stage
+                plan.stages[node]->run_async(
+                    state.context, executor_of(state, node),
+                    &state.executors.io(),
+                    [&state, node, start](std::exception_ptr error) {
+                        complete_async(state, node, start, error);
+                    });
+                return Outcome::Suspended;
+            }
+            std::optional<ContentHash> key = cache_key(state, node);
+            std::unique_ptr<MappedFile> cached;
+            if (key.has_value() && cache_readable(state, node)) {
+                cached = state.disk->find(*key);
+            }
+            if (cached) {
+                plan.serialize_ops[node]->read(
+                    state.context, plan.output_stage[node], cached->bytes());
+                if (plan.hash_output[node]) {
+                    ContentHasher hasher;
+                    hasher.update(cached->bytes());
+                    state.hashes[node] = hasher.digest();
+                }
+            } else {
+                std::span<IStage *const> chain(
+                    plan.fused.data() + plan.fused_offsets[node],
+                    plan.fused.data() + plan.fused_offsets[node + 1]);
+                if (chain.empty()) {
+                    plan.stages[node]->run(state.context);
+                } else {
+                    plan.stages[node]->run_fused(state.context, chain);
+                }
+                persist(state, node, key);
+                // Loading from the cache says nothing about the stage cost
+                std::chrono::duration<double, std::nano> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                record_cost(*plan.costs[node], elapsed.count());
+            }
+            remember(state, node);
+            record_node(state, node);
+            release_inputs(state, node);
+        } catch (...) {
+            fail(state, node, std::current_exception());
+            return Outcome::Failed;
+        }
+        return Outcome::Finished;
+    }
+
+    // Makes downstream of a finished node ready to run. One newly ready
+    // stage is returned to continue on this worker while its input is still
+    // hot in cache, only the rest go through the executor
+    static std::optional<size_t> release_downstream(RunState &state,
+                                                    size_t node) {
+        const ExecutionPlan &plan = state.plan;
+        std::optional<size_t> continuation;
+        if (state.failed.load()) {
+            return continuation;
+        }
+        for (size_t i = plan.downstream_offsets[node];
+             i < plan.downstream_offsets[node + 1]; i++) {
+            size_t downstream = plan.downstream[i];
+            if (state.indeg[downstream].fetch_sub(
+                    1, std::memory_order_acq_rel) != 1) {
+                continue;
+            }
+            // Stages of another execution class belong on their own pool
+            bool same_pool = plan.class_of[downstream] == plan.class_of[node];
+            if (!continuation.has_value() && same_pool) {
+                // Inherits the in_flight count of the finished stage
+                continuation = downstream;
+                continue;
+            }
+            if (same_pool && !state.priority.empty() &&
+                state.priority[downstream] > state.priority[*continuation]) {
+                std::swap(downstream, *continuation);
+            }
+            // Counted before this stage retires, so in_flight cannot drop
+            // to zero while work remains
+            state.in_flight.fetch_add(1);
+            schedule(state, downstream);
+        }
+        return continuation;
+    }
+
+    static void retire(RunState &state) {
+        if (state.in_flight.fetch_sub(1) == 1) {
+            // The waiting run() destroys the state once it observes done,
+            // so nothing may touch it after the lock is released
+            std::lock_guard<std::mutex> lg(state.mut);
+            state.done = true;
+            state.finished.notify_all();
+        }
+    }
+
+    static void run_stage(RunState &state, size_t node) {
+        while (true) {
+            Outcome outcome = execute(state, node);
+            if (outcome == Outcome::Suspended) {
+                // The stage retires once it completes
+                return;
+            }
+            std::optional<size_t> continuation;
+            if (outcome == Outcome::Finished) {
+                continuation = release_downstream(state, node);
+            }
+            if (!continuation.has_value()) {
+                break;
+            }
+            node = *continuation;
+        }
+        retire(state);
+    }
+
+    static void complete_async(RunState &state, size_t node,
+                               std::chrono::steady_clock::time_point start,
+                               std::exception_ptr error) {
+        if (!error) {
+            try {
+                persist(state, node, std::nullopt);
+                remember(state, node);
+                // Suspended time counts, it delays downstream stages all the
+                // same
+                std::chrono::duration<double, std::nano> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                record_cost(*state.plan.costs[node], elapsed.count());
+                record_node(state, node);
+                release_inputs(state, node);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        if (error) {
+            fail(state, node, error);
+            retire(state);
+            return;
+        }
+        std::optional<size_t> continuation = release_downstream(state, node);
+        if (continuation.has_value()) {
+            run_stage(state, *continuation);
+            return;
+        }
+        retire(state);
+    }
+
+  public:
+    Pipeline() = default;
+
+    template <class F>
+        requires(stage_invocable<F>())
+    auto add_stage(Key id, F &&func) -> Result<Port<stage_result_t<F>>> {
+        using Out = stage_result_t<F>;
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<Stage0<Out, std::decay_t<F>>>(
+                stages.size(), std::forward<F>(func));
+        return register_stage<Out>(std::move(id), std::move(stage_ptr), {});
+    }
+
+    template <class In, class F>
+        requires(stage_invocable<F, const In &>() ||
+                 stage_invocable<F, In &&>())
+    auto add_stage(Key id, F &&func, const Port<In> &upstream)
+        -> Result<Port<stage_result_t<F, stage_input_t<F, In>>>> {
+        using Out = stage_result_t<F, stage_input_t<F, In>>;
+        if (upstream.get_owner() != this) {
+            // This error prevents silent collisions of stage ids across
+            // pipelines
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<Stage1<Out, In, std::decay_t<F>>>(
+                stages.size(), upstream.id, std::forward<F>(func));
+        return register_stage<Out>(std::move(id), std::move(stage_ptr),
+                                   {upstream.id});
+    }
+
+    // Fan-in without intermediate join stages: the callable receives every
+    // input as a const reference to its stored value
+    template <class F, class In1, class In2, class... Rest>
+        requires(
+            stage_invocable<F, const In1 &, const In2 &, const Rest &...>())
+    auto add_stage(Key id, F &&func, const Port<In1> &in1,
+                   const Port<In2> &in2, const Port<Rest> &...rest)
+        -> Result<Port<
+            stage_result_t<F, const In1 &, const In2 &, const Rest &...>>> {
+        using Out =
+            stage_result_t<F, const In1 &, const In2 &, const Rest &...>;
+        if (in1.get_owner() != this || in2.get_owner() != this ||
+            ((rest.get_owner() != this) || ...)) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<StageN<Out, std::decay_t<F>, In1, In2, Rest...>>(
+                stages.size(),
+                std::array<size_t, 2 + sizeof...(Rest)>{in1.id, in2.id,
+                                                        rest.id...},
+                std::forward<F>(func));
+        return register_stage<Out>(std::move(id), std::move(stage_ptr),
+                                   {in1.id, in2.id, rest.id...});
+    }
+
+    // Stage whose callable mutates its input, which becomes the output of
+    // the stage. Reuses the upstream value whenever the plan makes this
+    // stage its only consumer
+    template <class T, class F>
+        requires(stage_invocable<F, T &>())
+    Result<Port<T>> add_inplace_stage(Key id, F &&func,
+                                      const Port<T> &upstream) {
+        if (upstream.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<InplaceStage<T, std::decay_t<F>>>(
+                stages.size(), upstream.id, std::forward<F>(func));
+        return register_stage<T>(std::move(id), std::move(stage_ptr),
+                                 {upstream.id});
+    }
+
+    // Pure stage without inputs whose value is replaced by set_source
+    template <class T>
+        requires std::copy_constructible<T>
+    Result<Port<T>> add_source(Key id, T value) {
+        auto cell = std::make_shared<SourceCell<T>>(std::move(value));
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<SourceStage<T>>(stages.size(), cell);
+        Result<Port<T>> port =
+            register_stage<T>(std::move(id), std::move(stage_ptr), {});
+        if (port.has_value()) {
+            source_cells[port->id] = std::move(cell);
+            pure[port->id] = true;
+        }
+        return port;
+    }
+
+    // Replaces the value of a source stage. The next run recomputes only the
+    // pure stages downstream of it, and stops at stages whose output did not
+    // change. Stages which are not pure run on every run regardless
+    template <class T>
+    Status set_source(const Port<T> &source, std::type_identity_t<T> value) {
+        if (source.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        auto cell =
+            std::static_pointer_cast<SourceCell<T>>(source_cells[source.id]);
+        if (!cell) {
+            return std::unexpected(Error::NotASource);
+        }
+        {
+            std::lock_guard<std::mutex> lg(cell->mut);
+            cell->value = std::move(value);
+        }
+        // Bumped after the value is set, so a run which starts with the new
+        // generation reads the new value. Runs already in flight drop their
+        // result instead of remembering it
+        std::lock_guard<std::mutex> lg(memo_store.mut);
+        memo_store.generations[source.id]++;
+        return std::monostate{};
+    }
+
+    Result<Port<std::monostate>>
+    write_bytes_to_file(Key id, const std::string &path,
+                        const Port<ByteBuffer> &bytes_input) {
+        if (bytes_input.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        return place_on_io(add_stage(
+            std::move(id),
+            [path](const ByteBuffer &data) {
+                std::ofstream f(path, std::ios::binary);
+                if (!f || !f.write(reinterpret_cast<const char *>(data.data()),
+                                   static_cast<std::streamsize>(data.size()))) {
+                    throw Error::IoError;
+                }
+                return std::monostate{};
+            },
+            bytes_input));
+    }
+
+    Result<Port<ByteBuffer>> read_bytes_from_file(
+        Key id, const std::string &path,
+        std::optional<Port<std::monostate>> after = std::nullopt) {
+        if (after.has_value() && after.value().get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        // Pure, since runs check the file for changes before reusing it
+        auto source = std::make_shared<FileSource>(path);
+        Result<Port<ByteBuffer>> port =
+            after.has_value()
+                ? add_stage(
+                      std::move(id),
+                      [source](std::monostate) { return source->read(); },
+                      after.value())
+                : add_stage(std::move(id), [source] { return source->read(); });
+        if (port.has_value()) {
+            file_sources[port.value().id] = std::move(source);
+            pure[port.value().id] = true;
+        }
+        return place_on_io(std::move(port));
+    }
+
+    template <class In1, class In2>
+    Result<Port<Joined<In1, In2>>> join(Key id, Port<In1> in1,
+                                        Port<In2> in2) {
+        if (in1.get_owner() != this || in2.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<JoinStage<In1, In2>>(stages.size(), in1.id,
+                                                  in2.id);
+        return register_stage<Joined<In1, In2>>(
+            std::move(id), std::move(stage_ptr), {in1.id, in2.id});
+    }
+
+    template <class F>
+        requires std::invocable<F> && is_task<std::invoke_result_t<F>>::value
+    auto add_async_stage(Key id, F &&func)
+        -> Result<Port<typename std::invoke_result_t<F>::value_type>> {
+        using Out = typename std::invoke_result_t<F>::value_type;
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<AsyncStage0<Out, std::decay_t<F>>>(
+                stages.size(), std::forward<F>(func));
+        return register_stage<Out>(std::move(id), std::move(stage_ptr), {});
+    }
+
+    template <class In, class F>
+        requires std::invocable<F, const In &> &&
+                 is_task<std::invoke_result_t<F, const In &>>::value
+    auto add_async_stage(Key id, F &&func, const Port<In> &upstream)
+        -> Result<
+            Port<typename std::invoke_result_t<F, const In &>::value_type>> {
+        using Out = typename std::invoke_result_t<F, const In &>::value_type;
+        if (upstream.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        std::unique_ptr<IStage> stage_ptr =
+            std::make_unique<AsyncStage1<Out, In, std::decay_t<F>>>(
+                stages.size(), upstream.id, std::forward<F>(func));
+        return register_stage<Out>(std::move(id), std::move(stage_ptr),
+                                   {upstream.id});
+    }
+
+    // Selects the pool of an ExecutorSet which runs a stage. Stages run on
+    // the CPU pool unless placed otherwise
+    template <class T>
+    Status place(const Port<T> &stage, ExecutionClass execution_class) {
+        if (stage.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        placement.at(stage.id) = std::move(execution_class);
+        graph_version++;
+        return std::monostate{};
+    }
+
+    // Keeps the value of a stage observable through result() after runs
+    // which compute it. Intermediate stages are otherwise free to be fused
+    // with their consumer, in which case their value is never stored
+    template <class T> Status retain(const Port<T> &stage) {
+        if (stage.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        if (!retained.at(stage.id)) {
+            retained[stage.id] = true;
+            graph_version++;
+        }
+        return std::monostate{};
+    }
+
+    // Declares that the output of a stage only depends on its inputs. Its
+    // value is kept across runs, and reused by runs in which none of its
+    // inputs changed instead of running the stage again. Stages which are
+    // not pure always run, so only pure stages downstream of pure stages
+    // are ever reused
+    //
+    // With a disk cache, the version is part of the key a stage's outputs
+    // are stored under, and should change whenever the stage's code does
+    template <class T>
+        requires std::copy_constructible<T>
+    Status mark_pure(const Port<T> &stage, std::string version = {}) {
+        if (stage.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        if (!pure.at(stage.id) || pure_versions[stage.id] != version) {
+            pure[stage.id] = true;
+            pure_versions[stage.id] = std::move(version);
+            graph_version++;
+        }
+        return std::monostate{};
+    }
+
+    // Persists the outputs of pure stages in a directory, where later runs
+    // of any process find them. Entries are keyed by a hash of the stage id,
+    // its version and the content of its inputs, so only stages whose
+    // output type and input types have a Serializer are persisted
+    Status set_disk_cache(DiskCacheOptions options) {
+        std::error_code ec;
+        if (!std::filesystem::is_directory(options.directory, ec)) {
+            return std::unexpected(Error::IoError);
+        }
+        disk_cache = std::make_shared<DiskCache>(options);
+        return std::monostate{};
+    }
+
+    // Drops the kept values of a stage and of everything downstream of it,
+    // so that the next runs compute them again. Runs already in flight do
+    // not keep the values they compute for these stages
+    template <class T> Status invalidate(const Port<T> &stage) {
+        if (stage.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        std::vector<bool> affected(stages.size(), false);
+        affected[stage.id] = true;
+        std::lock_guard<std::mutex> lg(memo_store.mut);
+        // Consumers have larger ids than their inputs
+        for (StageId id = stage.id; id < stages.size(); id++) {
+            if (!affected[id]) {
+                continue;
+            }
+            memo_store.memos[id] = Memo{};
+            memo_store.generations[id]++;
+            memo_store.invalidated[id] = true;
+            for_each_downstream(
+                id, [&](StageId downstream) { affected[downstream] = true; });
+        }
+        return std::monostate{};
+    }
+
+    // Value of a retained stage or of the target of the last run
+    template <class T> Result<T> result(const Port<T> &stage) const {
+        if (stage.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        std::shared_ptr<const Context> context;
+        {
+            std::lock_guard<std::mutex> lg(run_mut);
+            context = last_run;
+        }
+        if (!context) {
+            return std::unexpected(Error::ResultNotAvailable);
+        }
+        if (!context->contains(stage.id)) {
+            return std::unexpected(Error::ResultNotAvailable);
+        }
+        try {
+            return context->copy<T>(stage.id);
+        } catch (Error e) {
+            return std::unexpected(e);
+        }
+    }
+
+    // Memory statistics of the last successful run
+    Result<RunStats> run_stats() const {
+        std::lock_guard<std::mutex> lg(run_mut);
+        if (!last_run) {
+            return std::unexpected(Error::ResultNotAvailable);
+        }
+        return RunStats{last_run->peak_bytes(),  last_run->held_bytes(),
+                        last_run->arena_bytes(), last_run->spilled(),
+                        last_run->reloaded(),    last_run->spill_time(),
+                        last_run->reload_time()};
+    }
+
+    // Lets runs spill stage outputs to disk once they hold more bytes than
+    // the budget. Only values of types with a Serializer are spilled
+    Status set_spill_options(SpillOptions options) {
+        std::error_code ec;
+        if (!std::filesystem::is_directory(options.directory, ec)) {
+            return std::unexpected(Error::IoError);
+        }
+        spill_options = std::move(options);
+        return std::monostate{};
+    }
+
+    // Moving average of the measured execution time of a stage, if it ever
+    // ran or a cost was loaded for it
+    template <class T>
+    std::optional<std::chrono::nanoseconds>
+    estimated_cost(const Port<T> &stage) const {
+        double cost = stage_costs.at(stage.id).load();
+        if (cost < 0) {
+            return std::nullopt;
+        }
+        return std::chrono::nanoseconds(static_cast<int64_t>(cost));
+    }
+
+    // Writes one "<nanoseconds> <stage id>" line per stage with a known cost
+    Status save_costs(const std::string &path) const {
+        std::ofstream f(path);
+        if (!f) {
+            return std::unexpected(Error::IoError);
+        }
+        for (StageId stage = 0; stage < stages.size(); stage++) {
+            double cost = stage_costs[stage].load();
+            if (cost >= 0) {
+                f << cost << " " << *stage_keys[stage] << "\n";
+            }
+        }
+        if (!f) {
+            return std::unexpected(Error::IoError);
+        }
+        return std::monostate{};
+    }
+
+    // Seeds cost estimates from a file written by save_costs, applying to
+    // existing stages and to stages added later with the same id
+    Status load_costs(const std::string &path) {
+        std::ifstream f(path);
+        if (!f) {
+            return std::unexpected(Error::IoError);
+        }
+        double cost;
+        while (f >> cost) {
+            Key id;
+            f.ignore(1);
+            std::getline(f, id);
+            loaded_costs[id] = cost;
+            auto it = id_of.find(id);
+            if (it != id_of.end()) {
+                stage_costs[it->second].store(cost);
+            }
+        }
+        if (!f.eof()) {
+            return std::unexpected(Error::IoError);
+        }
+        return std::monostate{};
+    }
+
+    template <class T>
+    Result<T> run(const Port<T> &stage, size_t num_threads = 1) const {
+        return run(stage, num_threads, num_threads);
+    }
+
+    // Blocking I/O stages run on their own pool, which may be larger than
+    // the number of cores since its workers mostly wait
+    template <class T>
+    Result<T> run(const Port<T> &stage, size_t num_threads,
+                  size_t num_io_threads) const {
+        if (stage.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        auto hc = std::thread::hardware_concurrency();
+        if (num_threads == 0 || (hc != 0 && num_threads > hc) ||
+            num_io_threads == 0) {
+            return std::unexpected(Error::InvalidThreadCount);
+        }
+        Result<std::shared_ptr<const ExecutionPlan>> plan =
+            get_plan(stage.id);
+        if (!plan.has_value()) {
+            return std::unexpected(plan.error());
+        }
+        // Workers only live for this run, prefer binding long-lived
+        // Executors when running repeatedly. Named classes have no pool of
+        // their own here and run on the CPU pool, so the I/O pool is only
+        // started for plans which use it
+        Executor cpu(num_threads);
+        if (!plan.value()->uses_io_pool) {
+            return run(stage, cpu);
+        }
+        Executor io(num_io_threads, SchedulerPolicy::GlobalQueue);
+        return run(stage, ExecutorSet(cpu, io));
+    }
+
+    template <class T>
+    Result<T> run(const Port<T> &stage, Executor &executor) const {
+        return run(stage, ExecutorSet(executor));
+    }
+
+    // Safe to call from many threads at once, each run stores its results
+    // in a context of its own. The graph is read without locking, so it
+    // must not be mutated (add_*, join, place, retain, mark_pure and the
+    // like) while runs are in flight
+    template <class T>
+    Result<T> run(const Port<T> &stage, const ExecutorSet &executors) const {
+        if (stage.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        Result<std::shared_ptr<const ExecutionPlan>> plan_result =
+            get_plan(stage.id);
+        if (!plan_result.has_value()) {
+            return std::unexpected(plan_result.error());
+        }
+        // Shared with the plan cache, which a later compile may replace
+        std::shared_ptr<const ExecutionPlan> plan =
+            std::move(plan_result.value());
+
+        auto context = std::make_shared<Context>(plan->storage,
+                                                 arenas->acquire());
+        for (StageId id : plan->movable) {
+            context->allow_move(id);
+        }
+        for (StageId id : plan->sharable) {
+            context->allow_sharing(id);
+        }
+        if (spill_options.has_value()) {
+            context->enable_spilling(*spill_options);
+        }
+        // Files written since they were last read are read again
+        for (const auto &[file_stage, source] : plan->file_sources) {
+            if (source->changed()) {
+                std::lock_guard<std::mutex> lg(memo_store.mut);
+                memo_store.generations[file_stage]++;
+            }
+        }
+        RunState state(*plan, *context, executors, memo_store);
+        // Kept alive for the run even if the cache is replaced meanwhile
+        std::shared_ptr<DiskCache> disk = disk_cache;
+        state.disk = disk.get();
+        find_reusable(state);
+        for (Executor *pool : state.pools) {
+            if (pool->scheduler_policy() == SchedulerPolicy::CriticalPath) {
+                state.priority = upward_ranks(*plan);
+                break;
+            }
+        }
+        // Every source is counted before any of them can finish
+        state.in_flight = plan->sources.size();
+        for (size_t node : plan->sources) {
+            schedule(state, node);
+        }
+        {
+            // Wait until no task of this run can touch the state anymore
+            std::unique_lock<std::mutex> uniq(state.mut);
+            state.finished.wait(uniq, [&] { return state.done; });
+        }
+
+        if (state.failed.load()) {
+            return std::unexpected(state.err);
+        }
+
+        if (!context->contains(stage.id)) {
+            return std::unexpected(Error::UnknownStage);
+        }
+        std::optional<T> result;
+        try {
+            result.emplace(context->copy<T>(stage.id));
+        } catch (Error e) {
+            return std::unexpected(e);
+        }
+        std::lock_guard<std::mutex> lg(run_mut);
+        last_run = std::move(context);
+        return std::move(*result);
+    }
+
+    // Adds a target to rerun by watch, which passes each of its results to
+    // `on_result`
+    template <class T, class F>
+        requires std::invocable<F &, Result<T>>
+    Status add_watch(const Port<T> &target, F on_result) {
+        if (target.get_owner() != this) {
+            return std::unexpected(Error::MixingStagesAcrossPipelines);
+        }
+        watched.push_back(
+            {target.id,
+             [target, on_result = std::move(on_result)](
+                 const Pipeline &p, const ExecutorSet &executors) mutable {
+                 on_result(p.run(target, executors));
+             }});
+        return std::monostate{};
+    }
+
+    // Continuous mode: runs every target added by add_watch, then waits for
+    // files read by read_bytes_from_file to change and reruns only the
+    // targets which read them, until `stop` is requested. Each rerun is
+    // incremental, pure stages which do not depend on a changed file are
+    // reused. Changes are noticed through inotify on Linux, and by checking
+    // every poll_interval elsewhere, which also bounds how long a stop
+    // request waits
+    Status watch(std::stop_token stop, const ExecutorSet &executors,
+                 std::chrono::milliseconds poll_interval =
+                     std::chrono::milliseconds(100)) const {
+        std::vector<std::vector<std::shared_ptr<FileSource>>> reads;
+        std::vector<std::string> paths;
+        for (const WatchedTarget &watched_target : watched) {
+            Result<std::shared_ptr<const ExecutionPlan>> plan =
+                get_plan(watched_target.target);
+            if (!plan.has_value()) {
+                return std::unexpected(plan.error());
+            }
+            std::vector<std::shared_ptr<FileSource>> &files =
+                reads.emplace_back();
+            for (const auto &[stage, source] : plan.value()->file_sources) {
+                files.push_back(source);
+                paths.push_back(source->get_path());
+            }
+        }
+        // Watching starts before the first runs, so no write is missed
+        ChangeNotifier notifier(paths);
+        for (const WatchedTarget &watched_target : watched) {
+            watched_target.run(*this, executors);
+        }
+        while (!stop.stop_requested()) {
+            if (!notifier.wait(poll_interval)) {
+                continue;
+            }
+            for (size_t i = 0; i < watched.size(); i++) {
+                if (std::ranges::any_of(reads[i], [](const auto &source) {
+                        return source->changed();
+                    })) {
+                    watched[i].run(*this, executors);
+                }
+            }
+        }
+        return std::monostate{};
+    }
+
+    Status watch(std::stop_token stop, Executor &executor,
+                 std::chrono::milliseconds poll_interval =
+                     std::chrono::milliseconds(100)) const {
+        return watch(stop, ExecutorSet(executor), poll_interval);
     }
 };
 
-} // namespace pipeline
\ No newline at end of file
+} // namespace pipeline
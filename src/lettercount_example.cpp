@@ -3,8 +3,8 @@
 #include "pipeline_builder.hpp"
 using namespace pipeline;
 
-std::string convert_to_string(const std::vector<uint8_t>& bytes) {
-    return std::string(bytes.begin(), bytes.end());
+std::string convert_to_string(const ByteBuffer& bytes) {
+    return std::string(bytes.view());
 }
 
 std::unordered_map<char, size_t> letter_count(const std::string& str) {
@@ -16,12 +16,10 @@ std::unordered_map<char, size_t> letter_count(const std::string& str) {
     return freq;
 }
 
-std::string to_lowercase(const std::string& in) {
-    std::string result = in;
-    for (char &c : result) {
+void to_lowercase(std::string& str) {
+    for (char &c : str) {
         c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
     }
-    return result;
 }
 
 // Letter count
@@ -34,7 +32,7 @@ int main() {
     */
     Pipeline p;
 
-    Result<Port<std::vector<uint8_t>>> read_result 
+    Result<Port<ByteBuffer>> read_result 
         = p.read_bytes_from_file("read", "/Users/nikhil.jain/Documents/Personal_Work/lm_studio_interview/pipeline-builder/src/foo.txt");
     
     if (!read_result.has_value()) {
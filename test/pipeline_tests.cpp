@@ -1,12 +1,20 @@
 #include "pipeline_builder.hpp"
 #include <gtest/gtest.h>
+#include <condition_variable>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <set>
+#include <numeric>
 
 using namespace pipeline;
 
 auto src = []() { return 5; };
 auto incr = [](int x) { return x + 1; };
 auto triple = [](int x) { return x * 3; };
-auto sum = [](std::pair<int, int> pair) { return pair.first + pair.second; };
+auto sum = [](const Joined<int, int> &pair) {
+    return *pair.first + *pair.second;
+};
 
 auto message = []() { return std::string("Hello world"); };
 auto name = []() { return std::string("Nikhil"); };
@@ -17,18 +25,34 @@ auto to_upper = [](const std::string &s) {
     }
     return result;
 };
-auto string_to_bytes = [](const std::string &s) {
-    return std::vector<std::uint8_t>(s.begin(), s.end());
+auto string_to_bytes = [](std::string s) { return ByteBuffer(std::move(s)); };
+auto bytes_to_string = [](const ByteBuffer &bytes) {
+    return std::string(bytes.view());
 };
-auto bytes_to_string = [](const std::vector<std::uint8_t> &bytes) {
-    return std::string(bytes.begin(), bytes.end());
+
+auto sign_message = [](const Joined<std::string, std::string> &msg_name) {
+    return *msg_name.first + "\nFrom " + *msg_name.second;
 };
 
-auto sign_message =
-    [](const std::pair<std::string, std::string> &msg_name_pair) {
-        return std::string(msg_name_pair.first + "\nFrom " +
-                           msg_name_pair.second);
-    };
+// Blocks its callers until `expected` of them have arrived, which only
+// happens if they run concurrently. Gives up after a while instead of
+// hanging, returning whether everyone arrived
+struct Rendezvous {
+    std::mutex mut;
+    std::condition_variable cv;
+    int expected;
+    int arrived = 0;
+
+    explicit Rendezvous(int expected) : expected(expected) {}
+
+    bool arrive_and_wait() {
+        std::unique_lock<std::mutex> lk(mut);
+        arrived++;
+        cv.notify_all();
+        return cv.wait_for(lk, std::chrono::seconds(5),
+                           [&] { return arrived >= expected; });
+    }
+};
 
 TEST(PipelineTest, BuildSimpleStage) {
     Pipeline p;
@@ -106,7 +130,7 @@ TEST(PipelineTest, DiamondDependency) {
     Port<int> src_port = p.add_stage("src", src).value();
     Port<int> incr_port = p.add_stage("increment", incr, src_port).value();
     Port<int> triple_port = p.add_stage("triple", triple, src_port).value();
-    Port<std::pair<int, int>> join_port =
+    Port<Joined<int, int>> join_port =
         p.join("join", incr_port, triple_port).value();
     Port<int> sum_port = p.add_stage("sum", sum, join_port).value();
     Result<int> output = p.run(sum_port);
@@ -197,4 +221,1475 @@ TEST(PipelineTest, CannotMixStagesAcrossPipelines) {
 
     ASSERT_FALSE(bad_res.has_value());
     EXPECT_EQ(bad_res.error(), Error::MixingStagesAcrossPipelines);
-}
\ No newline at end of file
+}
+TEST(PipelineTest, ExecutorSharedAcrossRunsAndPipelines) {
+    Executor executor(2);
+
+    Pipeline p1;
+    Port<int> src_port = p1.add_stage("src", src).value();
+    Port<int> incr_port = p1.add_stage("incr", incr, src_port).value();
+
+    Pipeline p2;
+    Port<std::string> msg_port = p2.add_stage("message", message).value();
+    auto upper_port = p2.add_stage("upper", to_upper, msg_port).value();
+
+    for (int i = 0; i < 100; i++) {
+        Result<int> out1 = p1.run(incr_port, executor);
+        ASSERT_TRUE(out1.has_value());
+        ASSERT_EQ(out1.value(), 6);
+
+        Result<std::string> out2 = p2.run(upper_port, executor);
+        ASSERT_TRUE(out2.has_value());
+        ASSERT_EQ(out2.value(), "HELLO WORLD");
+    }
+}
+
+TEST(PipelineTest, ExecutorReportsStageFailure) {
+    Executor executor(2);
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    auto fail_port = p.add_stage(
+                          "fail",
+                          [](int x) -> int {
+                              if (x > 0) {
+                                  throw Error::IoError;
+                              }
+                              return x;
+                          },
+                          src_port)
+                         .value();
+    Port<int> triple_port = p.add_stage("triple", triple, fail_port).value();
+
+    Result<int> out = p.run(triple_port, executor);
+    ASSERT_FALSE(out.has_value());
+    EXPECT_EQ(out.error(), Error::IoError);
+
+    // The executor is still usable after a failed run
+    Result<int> ok = p.run(src_port, executor);
+    ASSERT_TRUE(ok.has_value());
+    EXPECT_EQ(ok.value(), 5);
+}
+
+TEST(PipelineTest, SchedulerPoliciesComputeSameResult) {
+    // Fan out from one source into 64 branches, then reduce them pairwise
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    std::vector<Port<int>> level;
+    for (int i = 0; i < 64; i++) {
+        level.push_back(p.add_stage("branch" + std::to_string(i),
+                                    [i](int x) { return x + i; }, src_port)
+                            .value());
+    }
+    int id = 0;
+    while (level.size() > 1) {
+        std::vector<Port<int>> next;
+        for (size_t i = 0; i < level.size(); i += 2) {
+            auto joined = p.join("join" + std::to_string(id), level[i],
+                                 level[i + 1])
+                              .value();
+            next.push_back(
+                p.add_stage("sum" + std::to_string(id), sum, joined).value());
+            id++;
+        }
+        level = std::move(next);
+    }
+
+    // 64 * 5 + (0 + 1 + ... + 63)
+    const int expected = 64 * 5 + 63 * 64 / 2;
+    for (auto policy :
+         {SchedulerPolicy::GlobalQueue, SchedulerPolicy::WorkStealing}) {
+        Executor executor(4, policy);
+        for (int i = 0; i < 20; i++) {
+            Result<int> out = p.run(level[0], executor);
+            ASSERT_TRUE(out.has_value());
+            ASSERT_EQ(out.value(), expected);
+        }
+    }
+}
+
+TEST(PipelineTest, PlanRecompiledAfterGraphChanges) {
+    Executor executor(2);
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    Port<int> incr_port = p.add_stage("incr", incr, src_port).value();
+
+    // Repeated runs reuse the cached plan
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(p.run(incr_port, executor).value(), 6);
+    }
+
+    // Extending the graph invalidates cached plans
+    Port<int> triple_port = p.add_stage("triple", triple, incr_port).value();
+    auto join_port = p.join("join", incr_port, triple_port).value();
+    Port<int> sum_port = p.add_stage("sum", sum, join_port).value();
+
+    ASSERT_EQ(p.run(incr_port, executor).value(), 6);
+    ASSERT_EQ(p.run(sum_port, executor).value(), 6 + 18);
+    ASSERT_EQ(p.run(triple_port, executor).value(), 18);
+}
+
+// src feeds a three stage chain and a single stage, both joined into sum.
+// Returns the order in which the chain head and the single stage ran.
+static std::vector<std::string> unbalanced_run_order(Pipeline &p) {
+    auto order = std::make_shared<std::vector<std::string>>();
+    auto step = [order](std::string name) {
+        return [order, name](int x) {
+            order->push_back(name);
+            return x + 1;
+        };
+    };
+    Port<int> src_port = p.add_stage("src", src).value();
+    Port<int> a1 = p.add_stage("a1", step("a1"), src_port).value();
+    Port<int> a2 = p.add_stage("a2", step("a2"), a1).value();
+    Port<int> a3 = p.add_stage("a3", step("a3"), a2).value();
+    Port<int> b1 = p.add_stage("b1", step("b1"), src_port).value();
+    auto join_port = p.join("join", a3, b1).value();
+    Port<int> sum_port = p.add_stage("sum", sum, join_port).value();
+
+    Executor executor(1, SchedulerPolicy::CriticalPath);
+    EXPECT_EQ(p.run(sum_port, executor).value(), 8 + 6);
+    return *order;
+}
+
+TEST(PipelineTest, CriticalPathStartsLongestChainFirst) {
+    Pipeline p;
+    std::vector<std::string> order = unbalanced_run_order(p);
+    ASSERT_EQ(order.size(), 4u);
+    EXPECT_EQ(order.front(), "a1");
+}
+
+TEST(PipelineTest, LoadedCostsDrivePriorities) {
+    const std::string cost_path = "costs.txt";
+    {
+        std::ofstream f(cost_path);
+        for (std::string id : {"src", "a1", "a2", "a3", "join", "sum"}) {
+            f << 1000 << " " << id << "\n";
+        }
+        f << 1e9 << " b1\n";
+    }
+
+    Pipeline p;
+    ASSERT_TRUE(p.load_costs(cost_path).has_value());
+    std::vector<std::string> order = unbalanced_run_order(p);
+    ASSERT_EQ(order.size(), 4u);
+    EXPECT_EQ(order.front(), "b1");
+
+    // Measured costs round trip through a file into a fresh pipeline
+    ASSERT_TRUE(p.save_costs(cost_path).has_value());
+    Pipeline fresh;
+    ASSERT_TRUE(fresh.load_costs(cost_path).has_value());
+    Port<int> src_port = fresh.add_stage("src", src).value();
+    ASSERT_TRUE(fresh.estimated_cost(src_port).has_value());
+    Port<int> other_port = fresh.add_stage("other", src).value();
+    EXPECT_FALSE(fresh.estimated_cost(other_port).has_value());
+}
+
+TEST(PipelineTest, LinearChainContinuesOnSameWorker) {
+    auto threads = std::make_shared<std::vector<std::thread::id>>();
+    std::mutex mut;
+    auto record = [threads, &mut](int x) {
+        std::lock_guard<std::mutex> lg(mut);
+        threads->push_back(std::this_thread::get_id());
+        return x + 1;
+    };
+
+    Pipeline p;
+    Port<int> port = p.add_stage("src", src).value();
+    for (int i = 0; i < 8; i++) {
+        port = p.add_stage("step" + std::to_string(i), record, port).value();
+    }
+
+    for (auto policy :
+         {SchedulerPolicy::GlobalQueue, SchedulerPolicy::WorkStealing,
+          SchedulerPolicy::CriticalPath}) {
+        Executor executor(4, policy);
+        threads->clear();
+        ASSERT_EQ(p.run(port, executor).value(), 5 + 8);
+        ASSERT_EQ(threads->size(), 8u);
+        for (const auto &id : *threads) {
+            EXPECT_EQ(id, threads->front());
+        }
+    }
+}
+
+struct CopyCounted {
+    static inline int copies = 0;
+    int value = 0;
+
+    CopyCounted() = default;
+    explicit CopyCounted(int value) : value(value) {}
+    CopyCounted(const CopyCounted &other) : value(other.value) { copies++; }
+    CopyCounted(CopyCounted &&other) = default;
+    CopyCounted &operator=(const CopyCounted &other) {
+        value = other.value;
+        copies++;
+        return *this;
+    }
+    CopyCounted &operator=(CopyCounted &&other) = default;
+};
+
+TEST(PipelineTest, FusedChainMovesIntermediates) {
+    Pipeline p;
+    auto src_port = p.add_stage("src", [] { return CopyCounted(5); }).value();
+    auto incr_port =
+        p.add_stage("incr",
+                    [](CopyCounted c) {
+                        c.value++;
+                        return c;
+                    },
+                    src_port)
+            .value();
+    auto triple_port =
+        p.add_stage("triple",
+                    [](CopyCounted c) {
+                        c.value *= 3;
+                        return c;
+                    },
+                    incr_port)
+            .value();
+    auto value_port =
+        p.add_stage("value", [](const CopyCounted &c) { return c.value; },
+                    triple_port)
+            .value();
+
+    CopyCounted::copies = 0;
+    ASSERT_EQ(p.run(value_port).value(), 18);
+    EXPECT_EQ(CopyCounted::copies, 0);
+
+    // Fused intermediates never reach the Context
+    EXPECT_EQ(p.result(incr_port).error(), Error::ResultNotAvailable);
+    EXPECT_EQ(p.result(value_port).value(), 18);
+}
+
+TEST(PipelineTest, RetainedStagesAreNotFused) {
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    Port<int> incr_port = p.add_stage("incr", incr, src_port).value();
+    Port<int> triple_port = p.add_stage("triple", triple, incr_port).value();
+    ASSERT_TRUE(p.retain(incr_port).has_value());
+
+    ASSERT_EQ(p.run(triple_port).value(), 18);
+    EXPECT_EQ(p.result(incr_port).value(), 6);
+    EXPECT_EQ(p.result(src_port).error(), Error::ResultNotAvailable);
+}
+
+TEST(PipelineTest, StagesReadStoredInputsInPlace) {
+    Pipeline p;
+    auto src_port = p.add_stage("src", [] { return CopyCounted(5); }).value();
+    auto read = [](const CopyCounted &c) { return c.value; };
+    Port<int> first = p.add_stage("first", read, src_port).value();
+    Port<int> second = p.add_stage("second", read, src_port).value();
+    auto both = p.join("both", src_port, src_port).value();
+
+    CopyCounted::copies = 0;
+    Joined<int, int> sums = p.run(p.join("sum", first, second).value()).value();
+    EXPECT_EQ(*sums.first + *sums.second, 10);
+    EXPECT_EQ(CopyCounted::copies, 0);
+
+    // A join holds handles to its inputs instead of copying them, and run()
+    // returns a copy of the handles
+    CopyCounted::copies = 0;
+    Joined<CopyCounted, CopyCounted> out = p.run(both).value();
+    EXPECT_EQ(out.first->value, 5);
+    EXPECT_EQ(out.first, out.second);
+    EXPECT_EQ(CopyCounted::copies, 0);
+}
+
+TEST(PipelineTest, SoleConsumersTakeOverTheirInputs) {
+    Pipeline p;
+    auto make = [] { return CopyCounted(5); };
+    auto src_port = p.add_stage("src", make).value();
+    // Not fused, since the stages run on different pools
+    ASSERT_TRUE(p.place(src_port, ExecutionClass::blocking_io()).has_value());
+    auto take = [](CopyCounted &&c) { return c.value; };
+    Port<int> taken = p.add_stage("taken", take, src_port).value();
+    auto by_value = [](CopyCounted c) { return c.value + 1; };
+
+    CopyCounted::copies = 0;
+    ASSERT_EQ(p.run(taken, 1).value(), 5);
+    EXPECT_EQ(CopyCounted::copies, 0);
+    EXPECT_EQ(p.result(src_port).error(), Error::ResultNotAvailable);
+
+    // A second consumer leaves each of them a copy to own
+    Port<int> copied = p.add_stage("copied", by_value, src_port).value();
+    CopyCounted::copies = 0;
+    Joined<int, int> both =
+        p.run(p.join("both", taken, copied).value(), 1).value();
+    EXPECT_EQ(*both.first, 5);
+    EXPECT_EQ(*both.second, 6);
+    EXPECT_EQ(CopyCounted::copies, 2);
+
+    // Retained values stay observable, so they are copied as well
+    ASSERT_TRUE(p.retain(src_port).has_value());
+    CopyCounted::copies = 0;
+    ASSERT_EQ(p.run(taken, 1).value(), 5);
+    EXPECT_EQ(CopyCounted::copies, 1);
+    EXPECT_EQ(p.result(src_port).value().value, 5);
+}
+
+TEST(PipelineTest, JoinsShareInputsWithOtherConsumers) {
+    Pipeline p;
+    auto first = p.add_stage("first", [] { return CopyCounted(1); }).value();
+    auto second = p.add_stage("second", [] { return CopyCounted(2); }).value();
+    Port<int> reader =
+        p.add_stage("reader", [](const CopyCounted &c) { return c.value; },
+                    first)
+            .value();
+    auto both = p.join("both", first, second).value();
+    auto sum = p.add_stage("sum",
+                           [](const Joined<CopyCounted, CopyCounted> &pair,
+                              int read) {
+                               return pair.first->value +
+                                      pair.second->value + read;
+                           },
+                           both, reader)
+                   .value();
+
+    CopyCounted::copies = 0;
+    ASSERT_EQ(p.run(sum).value(), 1 + 2 + 1);
+    EXPECT_EQ(CopyCounted::copies, 0);
+
+    // Handles stay valid once the run and its values are gone
+    Joined<CopyCounted, CopyCounted> out = p.run(both).value();
+    ASSERT_EQ(p.run(sum).value(), 4);
+    EXPECT_EQ(out.first->value + out.second->value, 3);
+    EXPECT_EQ(CopyCounted::copies, 0);
+}
+
+TEST(PipelineTest, AsyncStagesDoNotBlockWorkers) {
+    // A single worker starts eight stages whose blocking calls only all
+    // meet if they wait on the I/O pool at once
+    Executor cpu(1);
+    Executor io(8, SchedulerPolicy::GlobalQueue);
+    Rendezvous meeting(8);
+    std::atomic<int> met = 0;
+    Pipeline p;
+    std::vector<Port<int>> level;
+    for (int i = 0; i < 8; i++) {
+        level.push_back(
+            p.add_async_stage("wait" + std::to_string(i),
+                              [i, &meeting, &met]() -> Task<int> {
+                                  co_await blocking([&] {
+                                      if (meeting.arrive_and_wait()) {
+                                          met++;
+                                      }
+                                  });
+                                  co_return i;
+                              })
+                .value());
+    }
+    int id = 0;
+    while (level.size() > 1) {
+        std::vector<Port<int>> next;
+        for (size_t i = 0; i < level.size(); i += 2) {
+            auto joined = p.join("join" + std::to_string(id), level[i],
+                                 level[i + 1])
+                              .value();
+            next.push_back(
+                p.add_stage("sum" + std::to_string(id), sum, joined).value());
+            id++;
+        }
+        level = std::move(next);
+    }
+
+    Result<int> out = p.run(level[0], ExecutorSet(cpu, io));
+    ASSERT_TRUE(out.has_value());
+    EXPECT_EQ(out.value(), 0 + 1 + 2 + 3 + 4 + 5 + 6 + 7);
+    EXPECT_EQ(met, 8);
+}
+
+TEST(PipelineTest, BlockingCallsRunOnTheIoPool) {
+    Pipeline p;
+    Port<Executor *> ran_on =
+        p.add_async_stage("wait", []() -> Task<Executor *> {
+             co_return co_await blocking([] { return Executor::current(); });
+         }).value();
+    Executor cpu(1);
+    Executor io(2, SchedulerPolicy::GlobalQueue);
+    EXPECT_EQ(p.run(ran_on, ExecutorSet(cpu, io)).value(), &io);
+    // A single pool runs the blocking calls as well
+    EXPECT_EQ(p.run(ran_on, cpu).value(), &cpu);
+}
+
+TEST(PipelineTest, ExecutorDestroyedRightAfterAsyncRun) {
+    // The I/O pool resumes the stage on the executor, which the run may
+    // finish on before the resuming submit returns
+    Pipeline p;
+    Port<int> waited =
+        p.add_async_stage("wait", []() -> Task<int> {
+             co_return co_await blocking([] { return 7; });
+         }).value();
+    Executor io(2, SchedulerPolicy::GlobalQueue);
+    for (int i = 0; i < 200; i++) {
+        Executor executor(2);
+        ASSERT_EQ(p.run(waited, ExecutorSet(executor, io)).value(), 7);
+    }
+}
+
+TEST(PipelineTest, AsyncFileStages) {
+    const std::string path = "async.txt";
+    Executor executor(2);
+    Pipeline p;
+    Port<std::string> msg_port = p.add_stage("message", message).value();
+    auto bytes_port =
+        p.add_stage("to_bytes", string_to_bytes, msg_port).value();
+    auto write_port =
+        p.add_async_stage("write",
+                          [path](const ByteBuffer &bytes) {
+                              return write_file_async(path, bytes);
+                          },
+                          bytes_port)
+            .value();
+    auto read_port =
+        p.add_async_stage(
+             "read",
+             [path](std::monostate) { return read_file_async(path); },
+             write_port)
+            .value();
+    auto str_port =
+        p.add_stage("to_str", bytes_to_string, read_port).value();
+
+    Result<std::string> out = p.run(str_port, executor);
+    ASSERT_TRUE(out.has_value());
+    EXPECT_EQ(out.value(), "Hello world");
+
+    auto missing_port =
+        p.add_async_stage("missing", [] {
+             return read_file_async("does/not/exist.txt");
+         }).value();
+    Result<ByteBuffer> err = p.run(missing_port, executor);
+    ASSERT_FALSE(err.has_value());
+    EXPECT_EQ(err.error(), Error::IoError);
+}
+
+TEST(PipelineTest, StagesRunOnPoolOfTheirExecutionClass) {
+    Executor cpu(1);
+    Executor io(2, SchedulerPolicy::GlobalQueue);
+    Executor gpu(1);
+    ExecutorSet executors(cpu, io);
+    executors.add_pool("gpu", gpu);
+
+    auto pools =
+        std::make_shared<std::unordered_map<std::string, Executor *>>();
+    std::mutex mut;
+    auto record = [pools, &mut](std::string name) {
+        return [pools, &mut, name](int x) {
+            std::lock_guard<std::mutex> lg(mut);
+            (*pools)[name] = Executor::current();
+            return x + 1;
+        };
+    };
+
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    Port<int> compute =
+        p.add_stage("compute", record("compute"), src_port).value();
+    Port<int> blocking =
+        p.add_stage("blocking", record("blocking"), compute).value();
+    Port<int> kernel =
+        p.add_stage("kernel", record("kernel"), blocking).value();
+    Port<int> other = p.add_stage("other", record("other"), kernel).value();
+    ASSERT_TRUE(p.place(blocking, ExecutionClass::blocking_io()).has_value());
+    ASSERT_TRUE(p.place(kernel, ExecutionClass::named("gpu")).has_value());
+    // Named classes without a pool fall back to the CPU pool
+    ASSERT_TRUE(p.place(other, ExecutionClass::named("fpga")).has_value());
+
+    ASSERT_EQ(p.run(other, executors).value(), 5 + 4);
+    EXPECT_EQ(pools->at("compute"), &cpu);
+    EXPECT_EQ(pools->at("blocking"), &io);
+    EXPECT_EQ(pools->at("kernel"), &gpu);
+    EXPECT_EQ(pools->at("other"), &cpu);
+}
+
+TEST(PipelineTest, IoPoolMayExceedCoreCount) {
+    // Eight I/O stages only all meet if they wait at once, on an I/O pool
+    // larger than the machine
+    Rendezvous meeting(8);
+    std::atomic<int> met = 0;
+    Pipeline p;
+    std::vector<Port<int>> level;
+    for (int i = 0; i < 8; i++) {
+        level.push_back(p.add_stage("wait" + std::to_string(i), [&, i] {
+                             if (meeting.arrive_and_wait()) {
+                                 met++;
+                             }
+                             return i;
+                         }).value());
+        ASSERT_TRUE(
+            p.place(level.back(), ExecutionClass::blocking_io()).has_value());
+    }
+    int id = 0;
+    while (level.size() > 1) {
+        std::vector<Port<int>> next;
+        for (size_t i = 0; i < level.size(); i += 2) {
+            auto joined = p.join("join" + std::to_string(id), level[i],
+                                 level[i + 1])
+                              .value();
+            next.push_back(
+                p.add_stage("sum" + std::to_string(id), sum, joined).value());
+            id++;
+        }
+        level = std::move(next);
+    }
+
+    Result<int> out = p.run(level[0], 1, 8);
+    ASSERT_TRUE(out.has_value());
+    EXPECT_EQ(out.value(), 0 + 1 + 2 + 3 + 4 + 5 + 6 + 7);
+    EXPECT_EQ(met, 8);
+}
+
+#ifdef __linux__
+TEST(PipelineTest, IoPoolOnlyStartedForPlansUsingIt) {
+    auto threads = [] {
+        return std::distance(
+            std::filesystem::directory_iterator("/proc/self/task"),
+            std::filesystem::directory_iterator());
+    };
+    Pipeline p;
+    Port<std::ptrdiff_t> counted = p.add_stage("count", threads).value();
+    std::ptrdiff_t baseline = threads();
+    EXPECT_EQ(p.run(counted, 1, 8).value(), baseline + 1);
+
+    ASSERT_TRUE(p.place(counted, ExecutionClass::blocking_io()).has_value());
+    EXPECT_EQ(p.run(counted, 1, 8).value(), baseline + 1 + 8);
+}
+#endif
+
+TEST(PipelineTest, SimulatedTopologyPlacesWorkersOnNodes) {
+    // Workers of the other node would otherwise steal the task
+    Executor executor(ExecutorOptions{.num_threads = 4,
+                                      .topology = Topology::simulated(2, 2),
+                                      .pinning = Pinning::Core,
+                                      .steal_across_nodes = false});
+    EXPECT_EQ(executor.num_nodes(), 2);
+    EXPECT_FALSE(Executor::current_node().has_value());
+
+    for (size_t node : {0, 1}) {
+        std::promise<std::optional<size_t>> ran_on;
+        executor.submit([&] { ran_on.set_value(Executor::current_node()); },
+                        0, node);
+        EXPECT_EQ(ran_on.get_future().get(), node);
+    }
+}
+
+TEST(PipelineTest, StagesRunOnNodeOfTheirInputs) {
+    // Without stealing across nodes, stages only leave the node of their
+    // inputs if the pipeline submits them elsewhere
+    ExecutorOptions options{.num_threads = 4,
+                            .topology = Topology::simulated(2, 2),
+                            .steal_across_nodes = false};
+    Executor cpu(options);
+    options.policy = SchedulerPolicy::GlobalQueue;
+    Executor io(options);
+    ExecutorSet executors(cpu, io);
+
+    std::mutex mut;
+    std::unordered_map<std::string, std::optional<size_t>> nodes;
+    auto record = [&](std::string name) {
+        return [&, name](int x) {
+            std::lock_guard<std::mutex> lg(mut);
+            nodes[name] = Executor::current_node();
+            return x + 1;
+        };
+    };
+
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    Port<int> load = p.add_stage("load", record("load"), src_port).value();
+    Port<int> a = p.add_stage("a", record("a"), load).value();
+    Port<int> b = p.add_stage("b", record("b"), load).value();
+    Port<Joined<int, int>> ab = p.join("ab", a, b).value();
+    ASSERT_TRUE(p.place(load, ExecutionClass::blocking_io()).has_value());
+
+    // Stages released by the I/O pool are submitted to the CPU pool from
+    // outside of it
+    for (int i = 0; i < 20; i++) {
+        ASSERT_TRUE(p.run(ab, executors).has_value());
+        ASSERT_TRUE(nodes.at("load").has_value());
+        EXPECT_EQ(nodes.at("a"), nodes.at("load"));
+        EXPECT_EQ(nodes.at("b"), nodes.at("load"));
+    }
+}
+
+TEST(PipelineTest, TasksForNodesWithoutWorkersRunElsewhere) {
+    for (bool steal : {true, false}) {
+        for (SchedulerPolicy policy :
+             {SchedulerPolicy::WorkStealing, SchedulerPolicy::GlobalQueue}) {
+            // A single worker sits on node 0, node 1 has none
+            Executor executor(ExecutorOptions{
+                .num_threads = 1,
+                .policy = policy,
+                .topology = Topology::simulated(2, 1),
+                .steal_across_nodes = steal});
+            std::promise<std::optional<size_t>> ran_on;
+            executor.submit(
+                [&] { ran_on.set_value(Executor::current_node()); }, 0, 1);
+            EXPECT_EQ(ran_on.get_future().get(), 0u);
+        }
+    }
+}
+
+TEST(PipelineTest, PoolsOfDifferentSizesShareATopology) {
+    // Inputs produced on node 1 of the I/O pool give their consumers a hint
+    // for a node the CPU pool has no workers on
+    ExecutorOptions options{.num_threads = 1,
+                            .topology = Topology::simulated(2, 1),
+                            .steal_across_nodes = false};
+    Executor cpu(options);
+    options.num_threads = 4;
+    options.policy = SchedulerPolicy::GlobalQueue;
+    Executor io(options);
+    ExecutorSet executors(cpu, io);
+
+    std::mutex mut;
+    std::set<std::optional<size_t>> load_nodes;
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    Port<int> load = p.add_stage("load", [&](int x) {
+                          std::lock_guard<std::mutex> lg(mut);
+                          load_nodes.insert(Executor::current_node());
+                          return x + 1;
+                      },
+                      src_port)
+                          .value();
+    Port<int> a = p.add_stage("a", incr, load).value();
+    Port<int> b = p.add_stage("b", triple, load).value();
+    Port<Joined<int, int>> ab = p.join("ab", a, b).value();
+    // Submitted from outside both pools, the source is spread over the
+    // nodes of the I/O pool
+    ASSERT_TRUE(
+        p.place(src_port, ExecutionClass::blocking_io()).has_value());
+    ASSERT_TRUE(p.place(load, ExecutionClass::blocking_io()).has_value());
+
+    for (int i = 0; i < 50; i++) {
+        Joined<int, int> out = p.run(ab, executors).value();
+        ASSERT_EQ(*out.first + *out.second, 7 + 18);
+    }
+    EXPECT_TRUE(load_nodes.contains(1));
+}
+
+TEST(PipelineTest, ConcurrentRunsShareOnePipeline) {
+    std::atomic<int> next_request = 0;
+    Pipeline p;
+    Port<int> request =
+        p.add_stage("request", [&] { return next_request++; }).value();
+    Port<int> doubled =
+        p.add_stage("doubled", [](int x) { return 2 * x; }, request).value();
+    Port<int> tripled =
+        p.add_stage("tripled", [](int x) { return 3 * x; }, request).value();
+    Port<Joined<int, int>> both = p.join("both", doubled, tripled).value();
+    const Pipeline &shared = p;
+
+    Executor executor(4);
+    std::vector<std::thread> clients;
+    std::atomic<int> mismatches = 0;
+    for (int client = 0; client < 8; client++) {
+        clients.emplace_back([&] {
+            for (int i = 0; i < 100; i++) {
+                Result<Joined<int, int>> result = shared.run(both, executor);
+                if (!result.has_value() ||
+                    3 * *result->first != 2 * *result->second) {
+                    mismatches++;
+                }
+            }
+        });
+    }
+    for (std::thread &client : clients) {
+        client.join();
+    }
+    EXPECT_EQ(mismatches, 0);
+    EXPECT_EQ(next_request, 800);
+    EXPECT_TRUE(shared.result(both).has_value());
+}
+
+TEST(PipelineTest, ContextSlotsPublishOnce) {
+    Context context(3);
+    EXPECT_EQ(context.size(), 3);
+    EXPECT_FALSE(context.contains(1));
+    EXPECT_FALSE(context.contains(3));
+    EXPECT_THROW(context.get<int>(1), Error);
+
+    context.publish(1, 5);
+    ASSERT_TRUE(context.contains(1));
+    EXPECT_EQ(context.get<int>(1), 5);
+    EXPECT_FALSE(context.contains(0));
+    EXPECT_THROW(context.get<std::string>(1), Error);
+}
+
+struct Tracked {
+    static inline int live = 0;
+    int value;
+
+    explicit Tracked(int value) : value(value) { live++; }
+    Tracked(const Tracked &other) : value(other.value) { live++; }
+    ~Tracked() { live--; }
+};
+
+TEST(PipelineTest, ContextConstructsValuesInPlace) {
+    StorageLayout layout;
+    layout.offsets = {0, StorageLayout::none};
+    layout.capacities = {sizeof(Tracked), 0};
+    layout.bytes = sizeof(Tracked);
+    {
+        Context context(layout);
+        context.publish(0, Tracked(1));
+        // Slots without inline storage allocate on publish
+        context.publish(1, Tracked(2));
+        EXPECT_EQ(Tracked::live, 2);
+        EXPECT_EQ(context.get<Tracked>(0).value, 1);
+        EXPECT_EQ(context.get<Tracked>(1).value, 2);
+
+        context.release(0);
+        EXPECT_FALSE(context.contains(0));
+        EXPECT_EQ(Tracked::live, 1);
+    }
+    EXPECT_EQ(Tracked::live, 0);
+}
+
+TEST(PipelineTest, IntermediatesReleasedAfterLastConsumer) {
+    constexpr size_t kBytes = 1 << 20;
+    constexpr int kLength = 8;
+    Pipeline p;
+    EXPECT_EQ(p.run_stats().error(), Error::ResultNotAvailable);
+
+    Port<std::vector<std::uint8_t>> port =
+        p.add_stage("stage0", [] {
+             return std::vector<std::uint8_t>(kBytes, 0);
+         }).value();
+    auto forward = [](const std::vector<std::uint8_t> &bytes) {
+        std::vector<std::uint8_t> next = bytes;
+        next[0]++;
+        return next;
+    };
+    for (int i = 1; i < kLength; i++) {
+        port = p.add_stage("stage" + std::to_string(i), forward, port).value();
+        // Alternating pools keep stages from being fused
+        if (i % 2 == 1) {
+            ASSERT_TRUE(
+                p.place(port, ExecutionClass::blocking_io()).has_value());
+        }
+    }
+    Port<int> last =
+        p.add_stage("last",
+                    [](const std::vector<std::uint8_t> &bytes) {
+                        return static_cast<int>(bytes[0]);
+                    },
+                    port)
+            .value();
+
+    ASSERT_EQ(p.run(last, 1).value(), kLength - 1);
+    RunStats stats = p.run_stats().value();
+    // At most a stage's input and output are alive at once
+    EXPECT_GE(stats.peak_resident_bytes, kBytes);
+    EXPECT_LT(stats.peak_resident_bytes, 3 * kBytes);
+    EXPECT_EQ(stats.resident_bytes, sizeof(int));
+
+    // Retained stages are kept until the next run
+    ASSERT_TRUE(p.retain(port).has_value());
+    ASSERT_EQ(p.run(last, 1).value(), kLength - 1);
+    EXPECT_GT(p.run_stats().value().resident_bytes, kBytes);
+    EXPECT_EQ(p.result(port).value()[0], kLength - 1);
+}
+
+TEST(PipelineTest, MultiInputStageReadsInputsInPlace) {
+    Pipeline p;
+    auto counted =
+        p.add_stage("counted", [] { return CopyCounted(4); }).value();
+    Port<int> src_port = p.add_stage("src", src).value();
+    Port<std::string> name_port = p.add_stage("name", name).value();
+    Port<std::string> line =
+        p.add_stage("line",
+                    [](const CopyCounted &c, int x, const std::string &s) {
+                        return s + " " + std::to_string(c.value + x);
+                    },
+                    counted, src_port, name_port)
+            .value();
+
+    CopyCounted::copies = 0;
+    EXPECT_EQ(p.run(line).value(), name() + " 9");
+    EXPECT_EQ(CopyCounted::copies, 0);
+
+    std::vector<Port<int>> inputs;
+    for (int i = 0; i < 8; i++) {
+        inputs.push_back(
+            p.add_stage("input" + std::to_string(i), [i] { return i; })
+                .value());
+    }
+    auto add = [](auto... xs) { return (xs + ...); };
+    Port<int> total = p.add_stage("total", add, inputs[0], inputs[1],
+                                  inputs[2], inputs[3], inputs[4], inputs[5],
+                                  inputs[6], inputs[7])
+                          .value();
+    EXPECT_EQ(p.run(total, 1).value(), 0 + 1 + 2 + 3 + 4 + 5 + 6 + 7);
+
+    Pipeline other;
+    Port<int> foreign = other.add_stage("src", src).value();
+    EXPECT_EQ(p.add_stage("mixed", add, src_port, foreign).error(),
+              Error::MixingStagesAcrossPipelines);
+}
+
+TEST(PipelineTest, StagesAllocateOutputsFromRunArena) {
+    Pipeline p;
+    Port<int> src_port = p.add_stage("src", src).value();
+    std::pmr::memory_resource *used = nullptr;
+    Port<std::pmr::vector<int>> values =
+        p.add_stage("values",
+                    [&](int x, RunAllocator allocator) {
+                        std::pmr::vector<int> out(allocator);
+                        out.assign(1000, x);
+                        used = out.get_allocator().resource();
+                        return out;
+                    },
+                    src_port)
+            .value();
+    Port<int> total = p.add_stage("total",
+                                  [](const std::pmr::vector<int> &values) {
+                                      return std::accumulate(
+                                          values.begin(), values.end(), 0);
+                                  },
+                                  values)
+                          .value();
+    // The output of a stage which does not opt in is allocated as usual
+    Port<std::string> message_port = p.add_stage("message", message).value();
+    Port<std::string> upper =
+        p.add_stage("upper", to_upper, message_port).value();
+
+    ASSERT_EQ(p.run(total, 1).value(), 5 * 1000);
+    EXPECT_NE(used, nullptr);
+    EXPECT_NE(used, std::pmr::get_default_resource());
+    EXPECT_GE(p.run_stats().value().arena_bytes, 1000 * sizeof(int));
+
+    // The target is copied out of the arena, which is reused by later runs
+    std::pmr::vector<int> copied = p.run(values, 1).value();
+    EXPECT_EQ(copied.get_allocator().resource(),
+              std::pmr::get_default_resource());
+    EXPECT_EQ(p.run(upper, 1).value(), to_upper(message()));
+}
+
+TEST(PipelineTest, RunArenaKeepsBlockForReuse) {
+    RunArena arena;
+    EXPECT_EQ(arena.capacity(), 0);
+    EXPECT_NE(arena.allocate(4096, 64), nullptr);
+    EXPECT_NE(arena.allocate(100, 8), nullptr);
+    EXPECT_GE(arena.allocated_bytes(), 4196);
+
+    arena.reset();
+    EXPECT_EQ(arena.allocated_bytes(), 0);
+    EXPECT_GE(arena.capacity(), 4196);
+    size_t capacity = arena.capacity();
+    // The same allocations fit the kept block without growing it
+    EXPECT_NE(arena.allocate(4096, 64), nullptr);
+    EXPECT_NE(arena.allocate(100, 8), nullptr);
+    arena.reset();
+    EXPECT_EQ(arena.capacity(), capacity);
+}
+
+TEST(PipelineTest, ArenaPoolIsBounded) {
+    auto pool = std::make_shared<ArenaPool>(2, 1024);
+    {
+        std::vector<std::shared_ptr<RunArena>> held;
+        for (int i = 0; i < 4; i++) {
+            held.push_back(pool->acquire());
+            EXPECT_NE(held.back()->allocate(100, 8), nullptr);
+        }
+    }
+    EXPECT_EQ(pool->size(), 2u);
+
+    // Arenas which grew past the limit are freed instead of kept
+    std::shared_ptr<RunArena> large = pool->acquire();
+    EXPECT_NE(large->allocate(4096, 8), nullptr);
+    large.reset();
+    EXPECT_EQ(pool->size(), 1u);
+    EXPECT_LE(pool->acquire()->capacity(), 1024u);
+}
+
+TEST(PipelineTest, ColdIntermediatesSpillUnderMemoryBudget) {
+    constexpr size_t kBytes = 1 << 20;
+    constexpr int kSources = 6;
+    std::filesystem::path scratch =
+        std::filesystem::temp_directory_path() / "pipeline_spill_test";
+    std::filesystem::remove_all(scratch);
+    {
+        Pipeline p;
+        EXPECT_EQ(p.set_spill_options({0, scratch.string()}).error(),
+                  Error::IoError);
+        std::filesystem::create_directory(scratch);
+        ASSERT_TRUE(p.set_spill_options({2 * kBytes, scratch.string()})
+                        .has_value());
+
+        std::vector<Port<std::vector<std::uint8_t>>> sources;
+        for (int i = 0; i < kSources; i++) {
+            sources.push_back(
+                p.add_stage("source" + std::to_string(i), [i] {
+                     return std::vector<std::uint8_t>(kBytes, i + 1);
+                 }).value());
+        }
+        auto combine = [](const std::vector<std::uint8_t> &acc,
+                          const std::vector<std::uint8_t> &next) {
+            std::vector<std::uint8_t> sum = acc;
+            sum[0] += next[0];
+            return sum;
+        };
+        Port<std::vector<std::uint8_t>> acc = sources[0];
+        for (int i = 1; i < kSources; i++) {
+            acc = p.add_stage("combine" + std::to_string(i), combine, acc,
+                              sources[i])
+                      .value();
+        }
+        ASSERT_TRUE(p.retain(sources[0]).has_value());
+
+        // Every source runs before the combines on a single thread, so the
+        // earliest ones are spilled until their combine reloads them
+        std::vector<std::uint8_t> result = p.run(acc, 1).value();
+        EXPECT_EQ(result[0], kSources * (kSources + 1) / 2);
+        EXPECT_EQ(result[1], 1);
+        RunStats stats = p.run_stats().value();
+        EXPECT_GT(stats.spilled_bytes, 0);
+        EXPECT_GT(stats.reloaded_bytes, 0);
+        EXPECT_LE(stats.peak_resident_bytes, 3 * kBytes + 4096);
+        EXPECT_EQ(p.result(sources[0]).value(),
+                  std::vector<std::uint8_t>(kBytes, 1));
+    }
+    // Spill files are deleted along with the run
+    EXPECT_TRUE(std::filesystem::is_empty(scratch));
+    std::filesystem::remove_all(scratch);
+}
+
+TEST(PipelineTest, LostSpillFilesFailTheRun) {
+    constexpr size_t kBytes = 1 << 16;
+    std::filesystem::path scratch =
+        std::filesystem::temp_directory_path() / "pipeline_lost_spill_test";
+    std::filesystem::remove_all(scratch);
+    std::filesystem::create_directory(scratch);
+    Pipeline p;
+    ASSERT_TRUE(p.set_spill_options({kBytes, scratch.string()}).has_value());
+    std::vector<Port<std::vector<std::uint8_t>>> sources;
+    for (int i = 0; i < 4; i++) {
+        sources.push_back(p.add_stage("source" + std::to_string(i), [] {
+                               return std::vector<std::uint8_t>(kBytes, 1);
+                           }).value());
+    }
+    // The first combine deletes the values spilled meanwhile, which later
+    // combines fail to reload
+    auto combine = [&](const std::vector<std::uint8_t> &acc,
+                       const std::vector<std::uint8_t> &) {
+        for (const auto &entry :
+             std::filesystem::directory_iterator(scratch)) {
+            std::filesystem::remove(entry.path());
+        }
+        return acc;
+    };
+    Port<std::vector<std::uint8_t>> acc = sources[0];
+    for (int i = 1; i < 4; i++) {
+        acc = p.add_stage("combine" + std::to_string(i), combine, acc,
+                          sources[i])
+                  .value();
+    }
+    EXPECT_EQ(p.run(acc, 1).error(), Error::IoError);
+    std::filesystem::remove_all(scratch);
+}
+
+TEST(PipelineTest, ByteBufferSlicesShareStorage) {
+    const std::string path = "byte_buffer.txt";
+    {
+        std::ofstream f(path, std::ios::binary);
+        f << "header:payload";
+    }
+    Pipeline p;
+    Port<ByteBuffer> read_port = p.read_bytes_from_file("read", path).value();
+    auto header_port =
+        p.add_stage("header",
+                    [](const ByteBuffer &bytes) { return bytes.slice(0, 6); },
+                    read_port)
+            .value();
+    auto payload_port =
+        p.add_stage("payload",
+                    [](const ByteBuffer &bytes) { return bytes.slice(7); },
+                    read_port)
+            .value();
+    auto join_port = p.join("join", header_port, payload_port).value();
+    ASSERT_TRUE(p.retain(read_port).has_value());
+
+    Joined<ByteBuffer, ByteBuffer> out = p.run(join_port).value();
+    EXPECT_EQ(out.first->view(), "header");
+    EXPECT_EQ(out.second->view(), "payload");
+    // Neither the fan-out nor slicing copied the file contents
+    ByteBuffer whole = p.result(read_port).value();
+    EXPECT_EQ(out.first->data(), whole.data());
+    EXPECT_EQ(out.second->data(), whole.data() + 7);
+
+    ByteBuffer mapped = ByteBuffer::map_file(path);
+    EXPECT_EQ(mapped, whole);
+    EXPECT_EQ(mapped.slice(7, 3).view(), "pay");
+    EXPECT_TRUE(mapped.slice(14).empty());
+    EXPECT_THROW(mapped.slice(15), std::out_of_range);
+    EXPECT_THROW(ByteBuffer::map_file("does/not/exist.txt"), Error);
+}
+
+TEST(PipelineTest, StagesInternedToDenseIds) {
+    Pipeline p;
+    Port<int> first = p.add_stage("first", src).value();
+    const Key &name = first.get_id();
+    Port<int> port = first;
+    for (int i = 0; i < 1000; i++) {
+        port = p.add_stage("incr" + std::to_string(i), incr, port).value();
+    }
+    EXPECT_EQ(first.stage_id(), 0);
+    EXPECT_EQ(port.stage_id(), 1000);
+    // Names stay valid as the graph grows
+    EXPECT_EQ(name, "first");
+    EXPECT_EQ(port.get_id(), "incr999");
+    EXPECT_EQ(p.add_stage("incr5", incr, first).error(),
+              Error::StageAlreadyExists);
+    EXPECT_EQ(p.run(port).value(), 5 + 1000);
+}
+
+TEST(PipelineTest, PortsKeepNamesAfterPipeline) {
+    std::optional<Port<int>> port;
+    {
+        Pipeline p;
+        port = p.add_stage("first", src).value();
+    }
+    EXPECT_EQ(port->get_id(), "first");
+}
+
+TEST(PipelineTest, SmallTargetInLargeGraph) {
+    Pipeline p;
+    Port<int> port = p.add_stage("first", src).value();
+    for (int i = 0; i < 1000; i++) {
+        port = p.add_stage("incr" + std::to_string(i), incr, port).value();
+    }
+    // Only the last stages are in the plan, with ids far past its size
+    Port<int> base = p.add_stage("base", src).value();
+    Port<int> incr_port = p.add_stage("incr", incr, base).value();
+    Port<int> triple_port = p.add_stage("triple", triple, base).value();
+    Port<int> sum_port =
+        p.add_stage("sum", [](int a, int b) { return a + b; }, incr_port,
+                    triple_port)
+            .value();
+    ASSERT_TRUE(p.retain(incr_port).has_value());
+
+    EXPECT_EQ(p.run(sum_port).value(), 6 + 15);
+    EXPECT_EQ(p.result(sum_port).value(), 21);
+    EXPECT_EQ(p.result(incr_port).value(), 6);
+    EXPECT_EQ(p.result(port).error(), Error::ResultNotAvailable);
+    EXPECT_EQ(p.run(port).value(), 5 + 1000);
+    EXPECT_EQ(p.result(sum_port).error(), Error::ResultNotAvailable);
+}
+
+TEST(PipelineTest, InplaceStagesReuseSolelyOwnedInputs) {
+    Pipeline p;
+    auto src_port = p.add_stage("src", [] { return CopyCounted(5); }).value();
+    // Not fused, since the stages run on different pools
+    ASSERT_TRUE(p.place(src_port, ExecutionClass::blocking_io()).has_value());
+    auto bump = [](CopyCounted &c) { c.value++; };
+    Port<CopyCounted> bumped =
+        p.add_inplace_stage("bumped", bump, src_port).value();
+    // Fused behind the previous in-place stage
+    Port<CopyCounted> twice =
+        p.add_inplace_stage("twice", bump, bumped).value();
+
+    CopyCounted::copies = 0;
+    EXPECT_EQ(p.run(twice, 1).value().value, 7);
+    // Only run() copies out the target
+    EXPECT_EQ(CopyCounted::copies, 1);
+
+    // A second reader of the source leaves the in-place stage a copy
+    Port<int> reader =
+        p.add_stage("reader", [](const CopyCounted &c) { return c.value; },
+                    src_port)
+            .value();
+    auto both = p.join("both", twice, reader).value();
+    CopyCounted::copies = 0;
+    Joined<CopyCounted, int> out = p.run(both, 1).value();
+    EXPECT_EQ(out.first->value, 7);
+    EXPECT_EQ(*out.second, 5);
+    // For the in-place stage, the join and run() copy nothing
+    EXPECT_EQ(CopyCounted::copies, 1);
+}
+
+TEST(PipelineTest, PureStagesReusedAcrossRuns) {
+    /*
+      config   reading
+        |         |
+      parse       |
+         \       /
+          report
+    */
+    std::map<std::string, int> calls;
+    int reading = 1;
+    auto counted = [&](std::string name, auto func) {
+        return [&calls, name, func](auto... args) {
+            calls[name]++;
+            return func(args...);
+        };
+    };
+    Pipeline p;
+    Port<int> config =
+        p.add_stage("config", counted("config", [] { return 10; })).value();
+    Port<int> parse =
+        p.add_stage("parse", counted("parse", [](int x) { return x * 2; }),
+                    config)
+            .value();
+    Port<int> sensor =
+        p.add_stage("reading", [&] { return reading; }).value();
+    Port<int> report =
+        p.add_stage("report",
+                    counted("report", [](int x, int y) { return x + y; }),
+                    parse, sensor)
+            .value();
+    ASSERT_TRUE(p.mark_pure(config).has_value());
+    ASSERT_TRUE(p.mark_pure(parse).has_value());
+    ASSERT_TRUE(p.mark_pure(report).has_value());
+
+    EXPECT_EQ(p.run(report).value(), 21);
+    reading = 2;
+    EXPECT_EQ(p.run(report).value(), 22);
+    // The reading is not pure, so the report is recomputed on every run
+    // while the configuration is parsed once
+    EXPECT_EQ(calls["config"], 1);
+    EXPECT_EQ(calls["parse"], 1);
+    EXPECT_EQ(calls["report"], 2);
+
+    // Targets whose whole closure is unchanged are not run at all
+    EXPECT_EQ(p.run(parse).value(), 20);
+    EXPECT_EQ(calls["parse"], 1);
+
+    ASSERT_TRUE(p.invalidate(config).has_value());
+    EXPECT_EQ(p.run(parse).value(), 20);
+    EXPECT_EQ(calls["config"], 2);
+    EXPECT_EQ(calls["parse"], 2);
+}
+
+TEST(PipelineTest, InvalidateDuringRunDropsItsResult) {
+    int calls = 0;
+    Pipeline p;
+    std::optional<Port<int>> stage;
+    stage = p.add_stage("stage", [&] {
+                 // Invalidated by the first run itself, after it started
+                 if (++calls == 1) {
+                     EXPECT_TRUE(p.invalidate(*stage).has_value());
+                 }
+                 return 10;
+             }).value();
+    ASSERT_TRUE(p.mark_pure(*stage).has_value());
+
+    EXPECT_EQ(p.run(*stage).value(), 10);
+    EXPECT_EQ(p.run(*stage).value(), 10);
+    EXPECT_EQ(calls, 2);
+    EXPECT_EQ(p.run(*stage).value(), 10);
+    EXPECT_EQ(calls, 2);
+}
+
+TEST(PipelineTest, SourceChangesStopAtUnchangedOutputs) {
+    int digit_calls = 0;
+    int label_calls = 0;
+    Pipeline p;
+    Port<int> input = p.add_source("input", 1).value();
+    Port<int> digit = p.add_stage("digit",
+                                  [&](int x) {
+                                      digit_calls++;
+                                      return x % 10;
+                                  },
+                                  input)
+                          .value();
+    Port<std::string> label = p.add_stage("label",
+                                          [&](int d) {
+                                              label_calls++;
+                                              return "digit " +
+                                                     std::to_string(d);
+                                          },
+                                          digit)
+                                  .value();
+    ASSERT_TRUE(p.mark_pure(digit).has_value());
+    ASSERT_TRUE(p.mark_pure(label).has_value());
+
+    EXPECT_EQ(p.run(label).value(), "digit 1");
+    EXPECT_EQ(p.run(label).value(), "digit 1");
+    EXPECT_EQ(digit_calls, 1);
+
+    // The digit is recomputed but unchanged, so the label is reused
+    ASSERT_TRUE(p.set_source(input, 11).has_value());
+    EXPECT_EQ(p.run(label).value(), "digit 1");
+    EXPECT_EQ(digit_calls, 2);
+    EXPECT_EQ(label_calls, 1);
+
+    ASSERT_TRUE(p.set_source(input, 12).has_value());
+    EXPECT_EQ(p.run(label).value(), "digit 2");
+    EXPECT_EQ(digit_calls, 3);
+    EXPECT_EQ(label_calls, 2);
+
+    EXPECT_EQ(p.set_source(digit, 3).error(), Error::NotASource);
+}
+
+TEST(PipelineTest, SetSourceConvertsToTheSourceType) {
+    Pipeline p;
+    Port<std::string> greeting =
+        p.add_source("greeting", std::string("hello")).value();
+    ASSERT_TRUE(p.set_source(greeting, "bye").has_value());
+    EXPECT_EQ(p.run(greeting).value(), "bye");
+}
+
+// Calls a hook from within its second copy, the first one being taken from
+// the source while its lock is held
+struct CopyHook {
+    int value = 0;
+    static inline int copies = 0;
+    static inline std::function<void()> on_second_copy;
+
+    explicit CopyHook(int value) : value(value) {}
+    CopyHook(CopyHook &&) = default;
+    CopyHook &operator=(CopyHook &&) = default;
+    CopyHook &operator=(const CopyHook &) = default;
+    CopyHook(const CopyHook &other) : value(other.value) {
+        if (++copies == 2 && on_second_copy) {
+            std::exchange(on_second_copy, nullptr)();
+        }
+    }
+    bool operator==(const CopyHook &) const = default;
+};
+
+TEST(PipelineTest, SetSourceDuringRunIsSeenByTheNextRun) {
+    Pipeline p;
+    Port<CopyHook> input = p.add_source("input", CopyHook(1)).value();
+    Port<int> scaled = p.add_stage("scaled",
+                                   [](const CopyHook &x) {
+                                       return x.value * 10;
+                                   },
+                                   input)
+                           .value();
+    ASSERT_TRUE(p.mark_pure(scaled).has_value());
+
+    // Set while the first run keeps the value it read from the source
+    CopyHook::copies = 0;
+    CopyHook::on_second_copy = [&] {
+        ASSERT_TRUE(p.set_source(input, CopyHook(2)).has_value());
+    };
+    EXPECT_EQ(p.run(scaled).value(), 10);
+    EXPECT_EQ(CopyHook::on_second_copy, nullptr);
+    EXPECT_EQ(p.run(scaled).value(), 20);
+}
+
+TEST(PipelineTest, DiskCacheSharedAcrossPipelines) {
+    std::filesystem::path dir =
+        std::filesystem::temp_directory_path() / "pipeline_disk_cache_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+
+    int computed = 0;
+    std::string text = "hello";
+    // Each pipeline stands in for a separate process sharing the cache
+    auto build = [&](Pipeline &p, std::string version) {
+        EXPECT_TRUE(p.set_disk_cache({dir.string()}).has_value());
+        Port<std::string> source =
+            p.add_stage("source", [&] { return text; }).value();
+        Port<std::string> upper = p.add_stage("upper",
+                                              [&](const std::string &s) {
+                                                  computed++;
+                                                  return to_upper(s);
+                                              },
+                                              source)
+                                      .value();
+        EXPECT_TRUE(p.mark_pure(upper, std::move(version)).has_value());
+        return upper;
+    };
+
+    {
+        Pipeline p;
+        EXPECT_EQ(p.run(build(p, "v1")).value(), "HELLO");
+    }
+    {
+        Pipeline p;
+        EXPECT_EQ(p.run(build(p, "v1")).value(), "HELLO");
+    }
+    EXPECT_EQ(computed, 1);
+
+    // Changed inputs and versions are looked up under different keys
+    text = "world";
+    {
+        Pipeline p;
+        EXPECT_EQ(p.run(build(p, "v1")).value(), "WORLD");
+    }
+    {
+        Pipeline p;
+        EXPECT_EQ(p.run(build(p, "v2")).value(), "WORLD");
+    }
+    EXPECT_EQ(computed, 3);
+    EXPECT_EQ(std::distance(std::filesystem::directory_iterator(dir),
+                            std::filesystem::directory_iterator()),
+              3);
+
+    // Least recently used entries are evicted beyond the size limit
+    {
+        Pipeline p;
+        ASSERT_TRUE(p.set_disk_cache({dir.string(), 10}).has_value());
+        Port<std::string> source =
+            p.add_stage("source", [&] { return text; }).value();
+        Port<std::string> padded =
+            p.add_stage("padded",
+                        [](const std::string &s) { return s + "!!!!!"; },
+                        source)
+                .value();
+        ASSERT_TRUE(p.mark_pure(padded).has_value());
+        EXPECT_EQ(p.run(padded).value(), "world!!!!!");
+    }
+    size_t total = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        total += entry.file_size();
+    }
+    EXPECT_LE(total, 10);
+    EXPECT_EQ(Pipeline().set_disk_cache({"does/not/exist"}).error(),
+              Error::IoError);
+    std::filesystem::remove_all(dir);
+}
+
+// Writes a file with a modification time in the past, which file sources
+// trust not to change without changing the stamp
+static void write_old_file(const std::filesystem::path &path,
+                           const std::string &contents,
+                           std::chrono::minutes age) {
+    {
+        std::ofstream f(path, std::ios::binary);
+        f << contents;
+    }
+    std::filesystem::last_write_time(
+        path, std::filesystem::file_time_type::clock::now() - age);
+}
+
+TEST(PipelineTest, InvalidateBypassesDiskCache) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                                "pipeline_disk_cache_invalidate_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+
+    int calls = 0;
+    int suffix = 1;
+    auto build = [&](Pipeline &p) {
+        EXPECT_TRUE(p.set_disk_cache({dir.string()}).has_value());
+        Port<std::string> prefix =
+            p.add_stage("prefix", [] { return std::string("x"); }).value();
+        // Reads state the cache key does not cover
+        Port<std::string> label = p.add_stage("label",
+                                              [&](const std::string &s) {
+                                                  calls++;
+                                                  return s + std::to_string(
+                                                                 suffix);
+                                              },
+                                              prefix)
+                                      .value();
+        EXPECT_TRUE(p.mark_pure(label).has_value());
+        return label;
+    };
+
+    Pipeline p;
+    Port<std::string> label = build(p);
+    EXPECT_EQ(p.run(label).value(), "x1");
+    suffix = 2;
+    ASSERT_TRUE(p.invalidate(label).has_value());
+    EXPECT_EQ(p.run(label).value(), "x2");
+    EXPECT_EQ(calls, 2);
+
+    // The entry was overwritten with the recomputed value
+    Pipeline other;
+    EXPECT_EQ(other.run(build(other)).value(), "x2");
+    EXPECT_EQ(calls, 2);
+    std::filesystem::remove_all(dir);
+}
+
+TEST(PipelineTest, FileSourcesOnlyReadChangedFiles) {
+    std::filesystem::path path =
+        std::filesystem::temp_directory_path() / "pipeline_file_source.txt";
+    write_old_file(path, "abc", std::chrono::minutes(60));
+
+    int calls = 0;
+    Pipeline p;
+    Port<ByteBuffer> bytes = p.read_bytes_from_file("read", path).value();
+    Port<size_t> length = p.add_stage("length",
+                                      [&](const ByteBuffer &b) {
+                                          calls++;
+                                          return b.size();
+                                      },
+                                      bytes)
+                              .value();
+    ASSERT_TRUE(p.mark_pure(length).has_value());
+
+    const std::uint8_t *first = p.run(bytes).value().data();
+    EXPECT_EQ(p.run(bytes).value().data(), first);
+    EXPECT_EQ(p.run(length).value(), 3u);
+    EXPECT_EQ(p.run(length).value(), 3u);
+    EXPECT_EQ(calls, 1);
+
+    write_old_file(path, "abcd", std::chrono::minutes(30));
+    EXPECT_EQ(p.run(length).value(), 4u);
+    EXPECT_EQ(calls, 2);
+
+    // Rewritten with the same contents, the file is read again but nothing
+    // downstream of it runs
+    write_old_file(path, "abcd", std::chrono::minutes(10));
+    EXPECT_EQ(p.run(length).value(), 4u);
+    EXPECT_EQ(calls, 2);
+
+    // Recently written files are read on every run, since a write within
+    // the timestamp granularity would go unnoticed
+    {
+        std::ofstream f(path, std::ios::binary);
+        f << "abcde";
+    }
+    const std::uint8_t *recent = p.run(bytes).value().data();
+    EXPECT_NE(p.run(bytes).value().data(), recent);
+    EXPECT_EQ(p.run(length).value(), 5u);
+    std::filesystem::remove(path);
+}
+
+TEST(PipelineTest, WatchRerunsTargetsOfChangedFiles) {
+    std::filesystem::path dir =
+        std::filesystem::temp_directory_path() / "pipeline_watch_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+    write_old_file(dir / "a.txt", "abc", std::chrono::minutes(60));
+    write_old_file(dir / "b.txt", "xyz", std::chrono::minutes(60));
+
+    Pipeline p;
+    auto size_of = [](const ByteBuffer &b) { return b.size(); };
+    Port<size_t> a = p.add_stage("a", size_of,
+                                 p.read_bytes_from_file("read a", dir / "a.txt")
+                                     .value())
+                         .value();
+    Port<size_t> b = p.add_stage("b", size_of,
+                                 p.read_bytes_from_file("read b", dir / "b.txt")
+                                     .value())
+                         .value();
+    std::mutex mut;
+    std::condition_variable changed;
+    std::vector<size_t> a_results;
+    std::vector<size_t> b_results;
+    auto collect = [&](std::vector<size_t> &results) {
+        return [&](Result<size_t> result) {
+            std::lock_guard<std::mutex> lg(mut);
+            results.push_back(result.value_or(0));
+            changed.notify_all();
+        };
+    };
+    ASSERT_TRUE(p.add_watch(a, collect(a_results)).has_value());
+    ASSERT_TRUE(p.add_watch(b, collect(b_results)).has_value());
+    auto wait_until = [&](auto done) {
+        std::unique_lock<std::mutex> uniq(mut);
+        return changed.wait_for(uniq, std::chrono::seconds(10), done);
+    };
+
+    Executor executor(1);
+    std::jthread watcher([&](std::stop_token stop) {
+        EXPECT_TRUE(
+            p.watch(stop, executor, std::chrono::milliseconds(10)).has_value());
+    });
+    ASSERT_TRUE(wait_until([&] { return a_results.size() == 1; }));
+    ASSERT_TRUE(wait_until([&] { return b_results.size() == 1; }));
+
+    write_old_file(dir / "a.txt", "abcdef", std::chrono::minutes(30));
+    EXPECT_TRUE(wait_until([&] { return a_results.back() == 6; }));
+    watcher.request_stop();
+    watcher.join();
+    // b.txt never changed, so its target ran once
+    EXPECT_EQ(b_results, std::vector<size_t>{3});
+    std::filesystem::remove_all(dir);
+}